@@ -0,0 +1,458 @@
+// Benchmarks of the library, run on a corpus of synthetic Ogg Opus files that is
+// generated in a directory the first time: make bench, or opustags-bench DIR.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "opustags.h"
+
+// Minimum time each benchmark runs for, in seconds.
+#define BENCH_TIME 0.5
+
+// Files of the corpus. The audio is made of random packets of a 64 kbit/s
+// stream of 20 ms frames, which is all the tool looks at.
+typedef struct {
+    const char *name;
+    // Number of such files, in a directory of that name if more than one.
+    int files;
+    long seconds;
+    uint32_t comments;
+    // Size of the value of each comment.
+    size_t comment_size;
+    // Size of the PNG image of the cover art, if any.
+    size_t picture_size;
+} corpus_spec;
+
+const corpus_spec corpus[] = {
+    { "tiny", 1000, 1, 8, 16, 0 },
+    { "long.opus", 1, 2 * 3600, 8, 16, 0 },
+    { "comments.opus", 1, 10, 10000, 32, 0 },
+    { "pages.opus", 1, 10, 64, 4096, 0 },
+    { "cover.opus", 1, 10, 8, 16, 8 << 20 },
+};
+
+enum { TINY, LONG, COMMENTS, PAGES, COVER, CORPUS_SIZE };
+
+// Fields the comments are named after, in turn.
+const char *fields[] = {
+    "TITLE", "ARTIST", "ALBUM", "DATE", "GENRE", "TRACKNUMBER", "COMMENT", "ENCODER",
+};
+
+#define FIELD_COUNT (sizeof(fields) / sizeof(*fields))
+
+double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The corpus is the same from one run to the next.
+uint32_t random_state = 2463534242u;
+
+uint32_t next_random(void){
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+void fill_random(unsigned char *data, size_t len){
+    size_t i;
+    for(i=0; i<len; i++)
+        data[i] = next_random() >> 24;
+}
+
+// Render the comment header of a file of the corpus. It must be freed.
+unsigned char *make_packet(const corpus_spec *spec, long *len){
+    uint32_t count = spec->comments + (spec->picture_size > 0), i;
+    const char **comment = malloc(count * sizeof(char*));
+    uint32_t *lengths = malloc(count * sizeof(uint32_t));
+    char *values = malloc(spec->comments * (16 + spec->comment_size));
+    unsigned char *packet = NULL;
+    char *picture = NULL;
+    if(comment == NULL || lengths == NULL || values == NULL)
+        goto end;
+    for(i=0; i<spec->comments; i++){
+        char *s = values + i * (16 + spec->comment_size);
+        int n = sprintf(s, "%s=", fields[i % FIELD_COUNT]);
+        size_t j;
+        for(j=0; j<spec->comment_size; j++)
+            s[n + j] = 'a' + next_random() % 26;
+        comment[i] = s;
+        lengths[i] = n + spec->comment_size;
+    }
+    if(spec->picture_size > 0){
+        // A PNG signature and header, followed by noise.
+        unsigned char *image = malloc(spec->picture_size);
+        if(image == NULL)
+            goto end;
+        fill_random(image, spec->picture_size);
+        memcpy(image, "\x89PNG\r\n\x1a\n\0\0\0\x0dIHDR\0\0\x05\0\0\0\x05\0\x08\x02\0\0\0", 29);
+        int rc = make_picture(image, spec->picture_size, &picture);
+        free(image);
+        if(rc != OPUSTAGS_OK){
+            fprintf(stderr, "make_picture: %s\n", opustags_strerror(rc));
+            goto end;
+        }
+        comment[i] = picture;
+        lengths[i] = strlen(picture);
+    }
+    opus_tags tags = {
+        .vendor_string = "opustags-bench",
+        .vendor_length = 14,
+        .count = count,
+        .lengths = lengths,
+        .comment = comment,
+    };
+    *len = tags_size(&tags);
+    packet = malloc(*len);
+    if(packet != NULL)
+        render_tags(&tags, packet, *len);
+end:
+    free(comment);
+    free(lengths);
+    free(values);
+    free(picture);
+    return packet;
+}
+
+int write_pages(ogg_stream_state *os, FILE *out, int flush){
+    ogg_page og;
+    while(flush ? ogg_stream_flush(os, &og) : ogg_stream_pageout(os, &og)){
+        if(fwrite(og.header, 1, og.header_len, out) < og.header_len ||
+           fwrite(og.body, 1, og.body_len, out) < og.body_len)
+            return -1;
+    }
+    return 0;
+}
+
+// Write a file of the corpus.
+int generate(const corpus_spec *spec, const char *path){
+    static unsigned char head[19] = "OpusHead\x01\x02\x38\x01\x80\xbb\0\0\0\0\0";
+    unsigned char audio[160];
+    ogg_stream_state os;
+    ogg_packet op = { .packet = head, .bytes = sizeof(head), .b_o_s = 1 };
+    long len, i, frames = spec->seconds * 50;
+    unsigned char *packet = make_packet(spec, &len);
+    if(packet == NULL){
+        fputs("failure to allocate memory\n", stderr);
+        return -1;
+    }
+    FILE *out = fopen(path, "wb");
+    if(out == NULL){
+        perror(path);
+        free(packet);
+        return -1;
+    }
+    ogg_stream_init(&os, next_random());
+    ogg_stream_packetin(&os, &op);
+    int rc = write_pages(&os, out, 1);
+    op = (ogg_packet) { .packet = packet, .bytes = len, .packetno = 1 };
+    ogg_stream_packetin(&os, &op);
+    if(rc == 0)
+        rc = write_pages(&os, out, 1);
+    for(i=0; i<frames && rc == 0; i++){
+        fill_random(audio, sizeof(audio));
+        // A CELT fullband stereo frame of 20 ms.
+        audio[0] = 0xfc;
+        op = (ogg_packet) { .packet = audio, .bytes = sizeof(audio), .e_o_s = i == frames - 1,
+                            .granulepos = 312 + (i + 1) * 960, .packetno = i + 2 };
+        ogg_stream_packetin(&os, &op);
+        rc = write_pages(&os, out, 0);
+    }
+    if(rc == 0)
+        rc = write_pages(&os, out, 1);
+    ogg_stream_clear(&os);
+    free(packet);
+    if(fclose(out) == EOF)
+        rc = -1;
+    if(rc == -1)
+        perror(path);
+    return rc;
+}
+
+// Generate the files of the corpus that are missing.
+int make_corpus(const char *dir){
+    char path[4096];
+    int i, j;
+    if(mkdir(dir, 0777) == -1 && errno != EEXIST){
+        perror(dir);
+        return -1;
+    }
+    for(i=0; i<CORPUS_SIZE; i++){
+        const corpus_spec *spec = &corpus[i];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, spec->name);
+        if(spec->files > 1 && mkdir(path, 0777) == -1 && errno != EEXIST){
+            perror(path);
+            return -1;
+        }
+        for(j=0; j<spec->files; j++){
+            if(spec->files > 1)
+                snprintf(path, sizeof(path), "%s/%s/%04d.opus", dir, spec->name, j);
+            if(stat(path, &st) == 0)
+                continue;
+            if(j == 0)
+                fprintf(stderr, "generating %s/%s\n", dir, spec->name);
+            if(generate(spec, path) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+void report(const char *name, const char *file, double count, double elapsed, const char *unit){
+    printf("%-16s %-16s %12.1f %s\n", name, file, count / elapsed, unit);
+    fflush(stdout);
+}
+
+// The comments are parsed where they lie, and deleted or matched without being
+// read past their field name, so these go by the number of comments.
+void bench_parse(const corpus_spec *spec, unsigned char *packet, long len){
+    opus_tags tags;
+    long iterations = 0;
+    uint32_t count = 0;
+    double start = now(), elapsed;
+    do{
+        if(parse_tags((char*) packet, len, &tags) != OPUSTAGS_OK)
+            return;
+        count = tags.count;
+        free_tags(&tags);
+        iterations++;
+    }while((elapsed = now() - start) < BENCH_TIME);
+    report("parse_tags", spec->name, iterations * (count / 1e6), elapsed, "Mcomments/s");
+}
+
+void bench_render(const corpus_spec *spec, unsigned char *packet, long len){
+    opus_tags tags;
+    unsigned char *data = malloc(len);
+    long iterations = 0;
+    double start, elapsed;
+    if(data == NULL || parse_tags((char*) packet, len, &tags) != OPUSTAGS_OK){
+        free(data);
+        return;
+    }
+    start = now();
+    do{
+        render_tags(&tags, data, len);
+        iterations++;
+    }while((elapsed = now() - start) < BENCH_TIME);
+    report("render_tags", spec->name, iterations * (len / 1e6), elapsed, "MB/s");
+    free_tags(&tags);
+    free(data);
+}
+
+// Only the deletion is timed, as the tags are parsed again each time.
+void bench_delete(const corpus_spec *spec, unsigned char *packet, long len){
+    const char *to_delete[] = { "ARTIST", "COMMENT" };
+    opus_tags tags;
+    long iterations = 0;
+    uint32_t count = 0;
+    double start = now(), elapsed = 0;
+    do{
+        if(parse_tags((char*) packet, len, &tags) != OPUSTAGS_OK)
+            return;
+        count = tags.count;
+        double t = now();
+        delete_tags(&tags, to_delete, 2);
+        elapsed += now() - t;
+        free_tags(&tags);
+        iterations++;
+    }while(now() - start < BENCH_TIME);
+    report("delete_tags", spec->name, iterations * (count / 1e6), elapsed, "Mcomments/s");
+}
+
+// Keeps the compiler from dropping the matches.
+long matches;
+
+void bench_match(const corpus_spec *spec, unsigned char *packet, long len){
+    opus_tags tags;
+    long iterations = 0;
+    double start, elapsed;
+    uint32_t i;
+    if(parse_tags((char*) packet, len, &tags) != OPUSTAGS_OK)
+        return;
+    start = now();
+    do{
+        for(i=0; i<tags.count; i++)
+            matches += match_field(tags.comment[i], tags.lengths[i], "ARTIST");
+        iterations++;
+    }while((elapsed = now() - start) < BENCH_TIME);
+    report("match_field", spec->name, iterations * (tags.count / 1e6), elapsed, "Mcomments/s");
+    free_tags(&tags);
+}
+
+// Copy a file while setting a tag, as with -s TITLE=... -o.
+void bench_copy(opustags_context *ctx, const char *dir, const corpus_spec *spec){
+    const char *to_add[] = { "TITLE=opustags-bench" };
+    opustags_edits edits = { .to_add = to_add, .count_add = 1, .to_delete = to_add, .count_delete = 1, .pad = -1 };
+    char path[4096], path_out[4096];
+    struct stat st;
+    long iterations = 0;
+    double start, elapsed;
+    snprintf(path, sizeof(path), "%s/%s", dir, spec->name);
+    snprintf(path_out, sizeof(path_out), "%s/copy.out", dir);
+    int in = open(path, O_RDONLY);
+    FILE *out = fopen(path_out, "wb");
+    if(in == -1 || out == NULL || fstat(in, &st) == -1){
+        perror("open");
+        goto end;
+    }
+    start = now();
+    do{
+        rewind(out);
+        if(lseek(in, 0, SEEK_SET) == -1 || ftruncate(fileno(out), 0) == -1){
+            perror("copy");
+            goto end;
+        }
+        int rc = edit_file(ctx, &edits, in, out, 0, NULL, NULL);
+        if(rc == OPUSTAGS_OK && fflush(out) == EOF)
+            rc = OPUSTAGS_ERRNO;
+        if(rc != OPUSTAGS_OK){
+            fprintf(stderr, "%s: %s\n", path, rc == OPUSTAGS_ERRNO ? strerror(errno) : opustags_strerror(rc));
+            goto end;
+        }
+        iterations++;
+    }while((elapsed = now() - start) < BENCH_TIME);
+    report("copy", spec->name, iterations * (st.st_size / 1e6), elapsed, "MB/s");
+end:
+    if(in != -1)
+        close(in);
+    if(out != NULL)
+        fclose(out);
+    unlink(path_out);
+}
+
+// Rewrite the comment header of a copy of the file in place, flipping a tag
+// between two values of the same size.
+void bench_in_place(opustags_context *ctx, const char *dir, const corpus_spec *spec){
+    const char *values[] = { "TITLE=opustags-bench-0", "TITLE=opustags-bench-1" };
+    opustags_edits edits = { .count_add = 1, .to_delete = values, .count_delete = 1, .pad = -1 };
+    char path[4096], path_out[4096];
+    long iterations = 0;
+    double start, elapsed;
+    snprintf(path, sizeof(path), "%s/%s", dir, spec->name);
+    snprintf(path_out, sizeof(path_out), "%s/in-place.out", dir);
+    int in = open(path, O_RDONLY), fd = -1, rewritten;
+    FILE *out = fopen(path_out, "wb");
+    if(in == -1 || out == NULL){
+        perror("open");
+        goto end;
+    }
+    // Leave room for the longer title.
+    edits.to_add = values;
+    edits.pad = 64;
+    if(edit_file(ctx, &edits, in, out, 0, NULL, NULL) != OPUSTAGS_OK || fflush(out) == EOF){
+        fprintf(stderr, "%s: failure to copy\n", path);
+        goto end;
+    }
+    edits.pad = -1;
+    if((fd = open(path_out, O_RDWR)) == -1){
+        perror(path_out);
+        goto end;
+    }
+    start = now();
+    do{
+        edits.to_add = values + (iterations & 1);
+        int rc = rewrite_in_place(ctx, &edits, fd, NULL, NULL, &rewritten);
+        if(rc != OPUSTAGS_OK || !rewritten){
+            fprintf(stderr, "%s: %s\n", path_out, rc != OPUSTAGS_OK ? opustags_strerror(rc) : "not rewritten");
+            goto end;
+        }
+        iterations++;
+    }while((elapsed = now() - start) < BENCH_TIME);
+    report("in-place", spec->name, iterations, elapsed, "files/s");
+end:
+    if(in != -1)
+        close(in);
+    if(fd != -1)
+        close(fd);
+    if(out != NULL)
+        fclose(out);
+    unlink(path_out);
+}
+
+// List the tags of the files, all of them or only a field of the first one.
+void bench_list(opustags_context *ctx, const char *dir, const corpus_spec *spec, int flags){
+    const char *to_get[] = { "TITLE" };
+    opustags_edits edits = { .pad = -1 };
+    char path[4096];
+    long files = 0;
+    double start, elapsed;
+    if(flags & OPUSTAGS_LAZY){
+        edits.to_get = to_get;
+        edits.count_get = 1;
+    }
+    start = now();
+    do{
+        if(spec->files > 1)
+            snprintf(path, sizeof(path), "%s/%s/%04ld.opus", dir, spec->name, files % spec->files);
+        else
+            snprintf(path, sizeof(path), "%s/%s", dir, spec->name);
+        int in = open(path, O_RDONLY);
+        if(in == -1){
+            perror(path);
+            return;
+        }
+        int rc = edit_file(ctx, &edits, in, NULL, flags | OPUSTAGS_KEEP_CACHE, NULL, NULL);
+        close(in);
+        if(rc != OPUSTAGS_OK){
+            fprintf(stderr, "%s: %s\n", path, opustags_strerror(rc));
+            return;
+        }
+        files++;
+    }while((elapsed = now() - start) < BENCH_TIME);
+    report(flags & OPUSTAGS_LAZY ? "list --get" : "list", spec->name, files, elapsed, "files/s");
+}
+
+int main(int argc, char **argv){
+    if(argc != 2){
+        fputs("Usage: opustags-bench DIR\n", stderr);
+        return EXIT_FAILURE;
+    }
+    const char *dir = argv[1];
+    if(make_corpus(dir) == -1)
+        return EXIT_FAILURE;
+    opustags_context ctx;
+    if(init_context(&ctx) != OPUSTAGS_OK){
+        fputs("ogg_stream_init: couldn't create the streams\n", stderr);
+        return EXIT_FAILURE;
+    }
+    printf("%-16s %-16s %12s\n", "benchmark", "corpus", "rate");
+    int i;
+    for(i=0; i<CORPUS_SIZE; i++){
+        const corpus_spec *spec = &corpus[i];
+        if(i != COMMENTS && i != PAGES && i != COVER)
+            continue;
+        long len;
+        unsigned char *packet = make_packet(spec, &len);
+        if(packet == NULL){
+            fputs("failure to allocate memory\n", stderr);
+            return EXIT_FAILURE;
+        }
+        bench_parse(spec, packet, len);
+        bench_render(spec, packet, len);
+        bench_delete(spec, packet, len);
+        bench_match(spec, packet, len);
+        free(packet);
+    }
+    for(i=LONG; i<CORPUS_SIZE; i++)
+        bench_copy(&ctx, dir, &corpus[i]);
+    bench_in_place(&ctx, dir, &corpus[LONG]);
+    bench_in_place(&ctx, dir, &corpus[COVER]);
+    bench_list(&ctx, dir, &corpus[TINY], 0);
+    bench_list(&ctx, dir, &corpus[COMMENTS], 0);
+    bench_list(&ctx, dir, &corpus[COVER], 0);
+    bench_list(&ctx, dir, &corpus[COVER], OPUSTAGS_LAZY);
+    free_context(&ctx);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1811 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#include "opustags.h"
+
+#ifdef __APPLE__
+#include <libkern/OSByteOrder.h>
+#define htole32(x) OSSwapHostToLittleInt32(x)
+#define le32toh(x) OSSwapLittleToHostInt32(x)
+#endif
+
+const char *opustags_strerror(int error){
+    switch(error){
+        case OPUSTAGS_OK:
+            return "success";
+        case OPUSTAGS_ERRNO:
+            return strerror(errno);
+        case OPUSTAGS_NO_MEMORY:
+            return "out of memory";
+        case OPUSTAGS_INVALID_FILE:
+            return "opustags: invalid file";
+        case OPUSTAGS_INVALID_HEADER:
+            return "opustags: invalid identification header";
+        case OPUSTAGS_INVALID_TAGS:
+            return "opustags: invalid comment header";
+        case OPUSTAGS_NO_LINK:
+            return "opustags: no such link in the stream";
+        case OPUSTAGS_NO_PICTURE:
+            return "opustags: no picture in the comments";
+        case OPUSTAGS_INVALID_PICTURE:
+            return "opustags: invalid or unsupported picture";
+        case OPUSTAGS_PARTIAL_WRITE:
+            return "opustags: the comment header was partly overwritten, the file may be corrupt";
+        default:
+            return "opustags: internal error";
+    }
+}
+
+void free_tags(opus_tags *tags){
+    free(tags->lengths);
+    free(tags->comment);
+    while(tags->copies != NULL){
+        comment_copy *next = tags->copies->next;
+        free(tags->copies);
+        tags->copies = next;
+    }
+}
+
+// Reader over a packet laid out on the bodies of consecutive pages.
+typedef struct {
+    const ogg_page *pages;
+    int count;
+    int page;
+    long offset;
+    long left;
+} packet_reader;
+
+// Point data to the bytes that are contiguous at the position of the reader.
+static long packet_peek(packet_reader *r, const char **data){
+    while(r->page < r->count && r->offset == r->pages[r->page].body_len){
+        r->page++;
+        r->offset = 0;
+    }
+    if(r->page == r->count){
+        *data = "";
+        return 0;
+    }
+    *data = (const char*) r->pages[r->page].body + r->offset;
+    return r->pages[r->page].body_len - r->offset;
+}
+
+// Copy the next len bytes to dst, or skip them if dst is NULL.
+static int packet_read(packet_reader *r, void *dst, long len){
+    const char *data;
+    long n;
+    if(len > r->left)
+        return -1;
+    r->left -= len;
+    while(len > 0){
+        n = packet_peek(r, &data);
+        if(n > len)
+            n = len;
+        if(dst != NULL){
+            memcpy(dst, data, n);
+            dst = (char*) dst + n;
+        }
+        r->offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Return the string of length len at the position of the reader, which must hold
+// it. It is only copied when even its field name is split across pages.
+static const char *packet_string(packet_reader *r, uint32_t len, opus_tags *tags){
+    const char *data;
+    long n = packet_peek(r, &data);
+    if(len > n && memchr(data, '=', n) == NULL){
+        comment_copy *copy = malloc(sizeof(comment_copy) + len);
+        if(copy == NULL)
+            return NULL;
+        copy->next = tags->copies;
+        tags->copies = copy;
+        packet_read(r, copy->data, len);
+        return copy->data;
+    }
+    packet_read(r, NULL, len);
+    return data;
+}
+
+static int parse_tags_pages(const ogg_page *pages, int page_count, opus_tags *tags){
+    packet_reader r = { .pages = pages, .count = page_count };
+    char magic[8];
+    uint32_t n;
+    int i;
+    for(i=0; i<page_count; i++)
+        r.left += pages[i].body_len;
+    tags->lengths = NULL;
+    tags->comment = NULL;
+    tags->pages = pages;
+    tags->page_count = page_count;
+    tags->copies = NULL;
+    tags->trailing_data = 0;
+    tags->trailing = NULL;
+    if(packet_read(&r, magic, 8) == -1 || memcmp(magic, "OpusTags", 8) != 0)
+        return OPUSTAGS_INVALID_TAGS;
+    // Vendor
+    if(packet_read(&r, &n, 4) == -1)
+        return OPUSTAGS_INVALID_TAGS;
+    tags->vendor_length = le32toh(n);
+    if(tags->vendor_length > r.left)
+        return OPUSTAGS_INVALID_TAGS;
+    tags->vendor_string = packet_string(&r, tags->vendor_length, tags);
+    if(tags->vendor_string == NULL)
+        return OPUSTAGS_NO_MEMORY;
+    if(packet_read(&r, &n, 4) == -1){
+        free_tags(tags);
+        return OPUSTAGS_INVALID_TAGS;
+    }
+    // Count
+    tags->count = le32toh(n);
+    // Each comment takes at least 4 bytes.
+    if(tags->count > r.left / 4){
+        free_tags(tags);
+        return OPUSTAGS_INVALID_TAGS;
+    }
+    if(tags->count > 0){
+        tags->lengths = calloc(tags->count, sizeof(uint32_t));
+        tags->comment = calloc(tags->count, sizeof(char*));
+        if(tags->lengths == NULL || tags->comment == NULL){
+            free_tags(tags);
+            return OPUSTAGS_NO_MEMORY;
+        }
+    }
+    // Comment
+    uint32_t j;
+    for(j=0; j<tags->count; j++){
+        if(packet_read(&r, &n, 4) == -1 || (tags->lengths[j] = le32toh(n)) > r.left){
+            free_tags(tags);
+            return OPUSTAGS_INVALID_TAGS;
+        }
+        tags->comment[j] = packet_string(&r, tags->lengths[j], tags);
+        if(tags->comment[j] == NULL){
+            free_tags(tags);
+            return OPUSTAGS_NO_MEMORY;
+        }
+    }
+
+    // Trailing data is padding unless its first bit is set (RFC 7845, section 5.2),
+    // in which case it is kept.
+    const char *data;
+    if(packet_peek(&r, &data) > 0 && (*data & 1)){
+        tags->trailing_data = r.left;
+        tags->trailing = data;
+        tags->padding = 0;
+    }
+    else
+        tags->padding = r.left;
+
+    return OPUSTAGS_OK;
+}
+
+int parse_tags(char *data, long len, opus_tags *tags){
+    ogg_page page = { .body = (unsigned char*) data, .body_len = len };
+    int rc = parse_tags_pages(&page, 1, tags);
+    if(rc != OPUSTAGS_OK)
+        return rc;
+    // A single page never splits a string.
+    tags->pages = NULL;
+    tags->page_count = 0;
+    return OPUSTAGS_OK;
+}
+
+long tags_span(const opus_tags *tags, const char *s, long len, long offset, const char **data){
+    int lo = 0, hi = tags->page_count;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(s >= (const char*) tags->pages[mid].body + tags->pages[mid].body_len)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo == tags->page_count || s < (const char*) tags->pages[lo].body){
+        *data = s + offset;
+        return len - offset;
+    }
+    long left = (const char*) tags->pages[lo].body + tags->pages[lo].body_len - s;
+    len -= offset;
+    while(offset >= left){
+        offset -= left;
+        s = (const char*) tags->pages[++lo].body;
+        left = tags->pages[lo].body_len;
+    }
+    *data = s + offset;
+    left -= offset;
+    return left < len ? left : len;
+}
+
+long tags_size(const opus_tags *tags){
+    long len = 8 + 4 + tags->vendor_length + 4;
+    uint32_t i;
+    for(i=0; i<tags->count; i++)
+        len += 4 + tags->lengths[i];
+    return len + tags->trailing_data;
+}
+
+// Position in the serialized comment header, which is read field by field
+// straight from the opus_tags rather than built in memory.
+typedef struct {
+    const opus_tags *tags;
+    uint32_t part;
+    long offset;
+    unsigned char scratch[4];
+} tags_cursor;
+
+static const unsigned char zeros[4096];
+
+// Point data to the bytes following the cursor, up to the end of the current field.
+// Return their count, or 0 at the end of the header.
+static long tags_chunk(tags_cursor *c, const unsigned char **data){
+    const opus_tags *tags = c->tags;
+    for(;; c->part++, c->offset = 0){
+        const unsigned char *p = c->scratch;
+        long len = 4;
+        uint32_t n = 0, field = c->part - 4;
+        if(c->part == 0){
+            p = (const unsigned char*) "OpusTags";
+            len = 8;
+        }
+        else if(c->part == 1)
+            n = tags->vendor_length;
+        else if(c->part == 2){
+            p = (const unsigned char*) tags->vendor_string;
+            len = tags->vendor_length;
+        }
+        else if(c->part == 3)
+            n = tags->count;
+        else if(field < 2 * tags->count && field % 2 == 0)
+            n = tags->lengths[field / 2];
+        else if(field < 2 * tags->count){
+            p = (const unsigned char*) tags->comment[field / 2];
+            len = tags->lengths[field / 2];
+        }
+        else if(field == 2 * tags->count){
+            p = (const unsigned char*) tags->trailing;
+            len = tags->trailing_data;
+        }
+        else if(field == 2 * tags->count + 1){
+            if(c->offset == tags->padding)
+                continue;
+            *data = zeros;
+            len = tags->padding - c->offset;
+            return len < sizeof(zeros) ? len : sizeof(zeros);
+        }
+        else
+            return 0;
+        if(c->offset == len)
+            continue;
+        if(p == c->scratch){
+            n = htole32(n);
+            memcpy(c->scratch, &n, 4);
+        }
+        return tags_span(tags, (const char*) p, len, c->offset, (const char**) data);
+    }
+}
+
+// Copy the next len bytes of the header to dst.
+static void tags_copy(tags_cursor *c, unsigned char *dst, long len){
+    const unsigned char *data;
+    long n;
+    while(len > 0 && (n = tags_chunk(c, &data)) > 0){
+        if(n > len)
+            n = len;
+        memcpy(dst, data, n);
+        c->offset += n;
+        dst += n;
+        len -= n;
+    }
+}
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void){
+    uint32_t i, r;
+    int k;
+    for(i=0; i<256; i++){
+        r = i << 24;
+        for(k=0; k<8; k++)
+            r = r & 0x80000000 ? (r << 1) ^ 0x04c11db7 : r << 1;
+        crc_table[0][i] = r;
+    }
+    // crc_table[k][i] is the checksum of byte i followed by k zeros.
+    for(i=0; i<256; i++){
+        for(k=1; k<8; k++)
+            crc_table[k][i] = (crc_table[k-1][i] << 8) ^ crc_table[0][crc_table[k-1][i] >> 24];
+    }
+}
+
+// Update the Ogg page checksum crc with len more bytes.
+static uint32_t page_crc(uint32_t crc, const unsigned char *data, size_t len){
+    pthread_once(&crc_once, crc_init);
+    // Slicing-by-8: fold 8 bytes at a time.
+    while(len >= 8){
+        crc ^= (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+        crc = crc_table[7][crc >> 24] ^ crc_table[6][(crc >> 16) & 0xff] ^
+              crc_table[5][(crc >> 8) & 0xff] ^ crc_table[4][crc & 0xff] ^
+              crc_table[3][data[4]] ^ crc_table[2][data[5]] ^
+              crc_table[1][data[6]] ^ crc_table[0][data[7]];
+        data += 8;
+        len -= 8;
+    }
+    while(len-- > 0)
+        crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *data++];
+    return crc;
+}
+
+// Multiply a and b as polynomials modulo the one of the Ogg checksum.
+static uint32_t crc_multiply(uint32_t a, uint32_t b){
+    uint32_t r = 0;
+    int i;
+    for(i=31; i>=0; i--){
+        r = r & 0x80000000 ? (r << 1) ^ 0x04c11db7 : r << 1;
+        if((b >> i) & 1)
+            r ^= a;
+    }
+    return r;
+}
+
+// Update crc with n zero bytes, in a time logarithmic in n.
+static uint32_t crc_zeros(uint32_t crc, size_t n){
+    uint32_t power = 0x100; // x^8, one byte
+    while(n > 0){
+        if(n & 1)
+            crc = crc_multiply(crc, power);
+        power = crc_multiply(power, power);
+        n >>= 1;
+    }
+    return crc;
+}
+
+// Fold the ASCII upper case letters of the 8 bytes of w to lower case: the
+// high bit of each byte from 'A' to 'Z' is set, then moved down to 0x20.
+static uint64_t fold_word(uint64_t w){
+    uint64_t low = w & 0x7f7f7f7f7f7f7f7full;
+    uint64_t upper = (low + 0x3f3f3f3f3f3f3f3full) ^ (low + 0x2525252525252525ull);
+    return w | (upper & ~w & 0x8080808080808080ull) >> 2;
+}
+
+static unsigned char fold_byte(unsigned char c){
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+// Compare the field names a and b of len bytes, ignoring the case of ASCII
+// letters as field names are case-insensitive, 8 bytes at a time.
+static int same_field(const char *a, const char *b, size_t len){
+    uint64_t x, y;
+    size_t i;
+    for(i=0; i+8 <= len; i+=8){
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if(x != y && fold_word(x) != fold_word(y))
+            return 0;
+    }
+    for(; i<len; i++){
+        if(a[i] != b[i] && fold_byte(a[i]) != fold_byte(b[i]))
+            return 0;
+    }
+    return 1;
+}
+
+int match_field(const char *comment, uint32_t len, const char *field){
+    size_t field_len = strcspn(field, "=");
+    return len > field_len && comment[field_len] == '=' && same_field(comment, field, field_len);
+}
+
+// Hash the field name of the comment of len bytes, and set *name_len to its
+// length, or to len if it has no '='.
+static uint32_t hash_field(const char *comment, size_t len, size_t *name_len){
+    // FNV-1a over the field name, folded to lower case as field names are
+    // case-insensitive.
+    uint32_t h = 2166136261u;
+    size_t i;
+    for(i=0; i<len && comment[i] != '='; i++)
+        h = (h ^ fold_byte(comment[i])) * 16777619u;
+    *name_len = i;
+    return h;
+}
+
+// Field of filter_tags, with the length of its name.
+typedef struct {
+    const char *name;
+    size_t len;
+} field_entry;
+
+// Drop the comments matching any of the fields, or all the others if keep is set.
+static int filter_tags(opus_tags *tags, const char **fields, int count, int keep){
+    // Index the fields in a hash table, then drop the comments in a single
+    // pass that preserves the order of the others.
+    if(count == 0 || tags->count == 0)
+        return OPUSTAGS_OK;
+    uint32_t size = 1, mask, i, j, kept = 0;
+    while(size < 2 * (uint32_t) count)
+        size <<= 1;
+    mask = size - 1;
+    field_entry *table = calloc(size, sizeof(field_entry));
+    if(table == NULL)
+        return OPUSTAGS_NO_MEMORY;
+    int k;
+    for(k=0; k<count; k++){
+        size_t len;
+        uint32_t h = hash_field(fields[k], strlen(fields[k]), &len);
+        for(j = h & mask; table[j].name != NULL; j = (j + 1) & mask);
+        table[j].name = fields[k];
+        table[j].len = len;
+    }
+    for(i=0; i<tags->count; i++){
+        // The field name is found and hashed in a single pass.
+        size_t len;
+        uint32_t h = hash_field(tags->comment[i], tags->lengths[i], &len);
+        int match = 0;
+        if(len < tags->lengths[i]){
+            for(j = h & mask; table[j].name != NULL && !match; j = (j + 1) & mask)
+                match = table[j].len == len && same_field(tags->comment[i], table[j].name, len);
+        }
+        if(match == keep){
+            tags->lengths[kept] = tags->lengths[i];
+            tags->comment[kept] = tags->comment[i];
+            kept++;
+        }
+    }
+    tags->count = kept;
+    // No need to resize the arrays.
+    free(table);
+    return OPUSTAGS_OK;
+}
+
+int delete_tags(opus_tags *tags, const char **fields, int count){
+    return filter_tags(tags, fields, count, 0);
+}
+
+int keep_tags(opus_tags *tags, const char **fields, int count){
+    return filter_tags(tags, fields, count, 1);
+}
+
+int add_tags(opus_tags *tags, const char **tags_to_add, uint32_t count){
+    if(count == 0)
+        return OPUSTAGS_OK;
+    uint32_t *lengths = realloc(tags->lengths, (tags->count + count) * sizeof(uint32_t));
+    const char **comment = realloc(tags->comment, (tags->count + count) * sizeof(char*));
+    // Either array may have moved even if the other one couldn't.
+    if(lengths != NULL)
+        tags->lengths = lengths;
+    if(comment != NULL)
+        tags->comment = comment;
+    if(lengths == NULL || comment == NULL)
+        return OPUSTAGS_NO_MEMORY;
+    uint32_t i;
+    for(i=0; i<count; i++){
+        tags->lengths[tags->count + i] = strlen(tags_to_add[i]);
+        tags->comment[tags->count + i] = tags_to_add[i];
+    }
+    tags->count += count;
+    return OPUSTAGS_OK;
+}
+
+int edit_tags(opus_tags *tags, const opustags_edits *edits){
+    int rc = OPUSTAGS_OK;
+    if(edits->delete_all)
+        tags->count = 0;
+    else
+        rc = delete_tags(tags, edits->to_delete, edits->count_delete);
+    if(rc == OPUSTAGS_OK)
+        rc = add_tags(tags, edits->to_set, edits->count_set);
+    if(rc == OPUSTAGS_OK)
+        rc = add_tags(tags, edits->to_add, edits->count_add);
+    return rc;
+}
+
+// Base64, as used by METADATA_BLOCK_PICTURE. The encoder turns 12 bits at a time into
+// two characters, and the decoder 4 characters into 3 bytes with one lookup each, so
+// that neither branches on the data.
+static const char b64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char b64_pairs[4096][2];
+// b64_values[k][c] is the value of character c shifted to its place among 4, or
+// B64_INVALID if it isn't part of the alphabet.
+#define B64_INVALID 0x80000000
+static uint32_t b64_values[4][256];
+static pthread_once_t b64_once = PTHREAD_ONCE_INIT;
+
+static void b64_init(void){
+    int i, k;
+    for(i=0; i<4096; i++){
+        b64_pairs[i][0] = b64_alphabet[i >> 6];
+        b64_pairs[i][1] = b64_alphabet[i & 63];
+    }
+    for(k=0; k<4; k++){
+        for(i=0; i<256; i++)
+            b64_values[k][i] = B64_INVALID;
+        for(i=0; i<64; i++)
+            b64_values[k][(unsigned char) b64_alphabet[i]] = (uint32_t) i << (18 - 6 * k);
+    }
+}
+
+// Encode len bytes of src to dst, padding the last characters, and return the end of dst.
+static char *b64_encode(const unsigned char *src, size_t len, char *dst){
+    pthread_once(&b64_once, b64_init);
+    for(; len >= 3; src += 3, len -= 3, dst += 4){
+        uint32_t v = (uint32_t) src[0] << 16 | src[1] << 8 | src[2];
+        memcpy(dst, b64_pairs[v >> 12], 2);
+        memcpy(dst + 2, b64_pairs[v & 0xfff], 2);
+    }
+    if(len > 0){
+        uint32_t v = (uint32_t) src[0] << 16 | (len > 1 ? src[1] << 8 : 0);
+        memcpy(dst, b64_pairs[v >> 12], 2);
+        dst[2] = len > 1 ? b64_alphabet[(v >> 6) & 63] : '=';
+        dst[3] = '=';
+        dst += 4;
+    }
+    return dst;
+}
+
+// Decoder of base64 coming in several chunks, as a comment may span pages.
+typedef struct {
+    char quad[4];
+    int count;
+    // Set once the padding was found, after which nothing may come.
+    int end;
+} b64_decoder;
+
+// Decode the 4 characters of quad to dst, and return the number of bytes, or -1 if invalid.
+static int b64_quad(b64_decoder *d, const char *quad, unsigned char *dst){
+    const unsigned char *q = (const unsigned char*) quad;
+    uint32_t v = b64_values[0][q[0]] | b64_values[1][q[1]] | b64_values[2][q[2]] | b64_values[3][q[3]];
+    int n = 3;
+    if(d->end)
+        return -1;
+    if(v & B64_INVALID){
+        // Only the last quad may be padded.
+        if(q[3] != '=')
+            return -1;
+        n = q[2] == '=' ? 1 : 2;
+        v = b64_values[0][q[0]] | b64_values[1][q[1]] | (n == 2 ? b64_values[2][q[2]] : 0);
+        if(v & B64_INVALID)
+            return -1;
+        d->end = 1;
+    }
+    dst[0] = v >> 16;
+    dst[1] = v >> 8;
+    dst[2] = v;
+    return n;
+}
+
+// Decode len more characters of src to dst, which has room for (len + 3) / 4 * 3 bytes.
+// Return the number of bytes written, or -1 if the input is invalid.
+static long b64_decode(b64_decoder *d, const char *src, long len, unsigned char *dst){
+    pthread_once(&b64_once, b64_init);
+    long written = 0;
+    int n;
+    if(d->count > 0){
+        while(d->count < 4 && len > 0){
+            d->quad[d->count++] = *src++;
+            len--;
+        }
+        if(d->count < 4)
+            return 0;
+        if((n = b64_quad(d, d->quad, dst)) == -1)
+            return -1;
+        written += n;
+        d->count = 0;
+    }
+    for(; len >= 4; src += 4, len -= 4){
+        if((n = b64_quad(d, src, dst + written)) == -1)
+            return -1;
+        written += n;
+    }
+    memcpy(d->quad, src, len);
+    d->count = len;
+    return written;
+}
+
+// Reader of the data of a FLAC picture block (RFC 9639, section 8.8): its picture type,
+// MIME type length and MIME type, description length and description, width, height,
+// color depth and count, then the picture length and picture. field is the index of
+// the one being read in that list, once the sizes are joined with what they measure.
+typedef struct {
+    int field;
+    uint32_t value, left;
+} picture_reader;
+
+// Pass the picture among the len bytes of p to out.
+static int picture_feed(picture_reader *r, const unsigned char *p, size_t len, FILE *out){
+    while(len > 0 && r->field < 8){
+        size_t n = len < r->left ? len : r->left, i;
+        if(r->field == 7){
+            if(fwrite(p, 1, n, out) < n)
+                return -1;
+        }
+        else if(r->field != 2 && r->field != 4 && r->field != 5){
+            for(i=0; i<n; i++)
+                r->value = r->value << 8 | p[i];
+        }
+        p += n;
+        len -= n;
+        r->left -= n;
+        // The MIME type, description and picture take the length read before them.
+        while(r->left == 0 && r->field < 8){
+            r->field++;
+            r->left = r->field == 2 || r->field == 4 || r->field == 7 ? r->value : r->field == 5 ? 16 : 4;
+            r->value = 0;
+        }
+    }
+    return 0;
+}
+
+#define PICTURE_FIELD "METADATA_BLOCK_PICTURE"
+
+int export_picture(const opus_tags *tags, FILE *out){
+    uint32_t i;
+    for(i=0; i<tags->count && !match_field(tags->comment[i], tags->lengths[i], PICTURE_FIELD); i++);
+    if(i == tags->count)
+        return OPUSTAGS_NO_PICTURE;
+    b64_decoder d = { .count = 0 };
+    picture_reader r = { .field = 0, .left = 4 };
+    unsigned char buf[3 * 16384];
+    const char *data;
+    long offset, n;
+    for(offset = sizeof(PICTURE_FIELD); offset < tags->lengths[i]; offset += n){
+        n = tags_span(tags, tags->comment[i], tags->lengths[i], offset, &data);
+        if(n > 4 * 16384)
+            n = 4 * 16384;
+        long decoded = b64_decode(&d, data, n, buf);
+        if(decoded == -1)
+            return OPUSTAGS_INVALID_PICTURE;
+        if(picture_feed(&r, buf, decoded, out) == -1)
+            return OPUSTAGS_ERRNO;
+    }
+    // The padding may have been left out.
+    if(d.count >= 2){
+        memset(d.quad + d.count, '=', 4 - d.count);
+        int decoded = b64_quad(&d, d.quad, buf);
+        if(decoded == -1)
+            return OPUSTAGS_INVALID_PICTURE;
+        if(picture_feed(&r, buf, decoded, out) == -1)
+            return OPUSTAGS_ERRNO;
+    }
+    else if(d.count == 1)
+        return OPUSTAGS_INVALID_PICTURE;
+    if(r.field < 8)
+        return OPUSTAGS_INVALID_PICTURE;
+    return fflush(out) == EOF ? OPUSTAGS_ERRNO : OPUSTAGS_OK;
+}
+
+static uint32_t be32(const unsigned char *p){
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_be32(unsigned char *p, uint32_t v){
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+int make_picture(const unsigned char *image, size_t size, char **comment){
+    // The MIME type, and what the header tells of the dimensions.
+    const char *mime;
+    uint32_t width = 0, height = 0, depth = 0;
+    *comment = NULL;
+    if(size >= 24 && memcmp(image, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(image + 12, "IHDR", 4) == 0){
+        static const int channels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+        mime = "image/png";
+        width = be32(image + 16);
+        height = be32(image + 20);
+        if(size >= 26 && image[25] < 7)
+            depth = image[24] * channels[image[25]];
+    }
+    else if(size >= 3 && memcmp(image, "\xff\xd8\xff", 3) == 0){
+        mime = "image/jpeg";
+        // The dimensions are in the first start of frame segment.
+        size_t pos = 2;
+        while(pos + 4 <= size && image[pos] == 0xff){
+            int marker = image[pos + 1];
+            if(marker == 0xff){
+                pos++;
+                continue;
+            }
+            if(marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc){
+                if(pos + 10 <= size){
+                    height = image[pos + 5] << 8 | image[pos + 6];
+                    width = image[pos + 7] << 8 | image[pos + 8];
+                    depth = image[pos + 4] * image[pos + 9];
+                }
+                break;
+            }
+            pos += 2 + (image[pos + 2] << 8 | image[pos + 3]);
+        }
+    }
+    else if(size >= 10 && (memcmp(image, "GIF87a", 6) == 0 || memcmp(image, "GIF89a", 6) == 0)){
+        mime = "image/gif";
+        width = image[6] | image[7] << 8;
+        height = image[8] | image[9] << 8;
+    }
+    else if(size >= 12 && memcmp(image, "RIFF", 4) == 0 && memcmp(image + 8, "WEBP", 4) == 0)
+        mime = "image/webp";
+    else
+        return OPUSTAGS_INVALID_PICTURE;
+    // The block header, followed by the first bytes of the picture, as many as needed
+    // for the rest to start on a group of 3 bytes.
+    size_t mime_len = strlen(mime), header_len = 32 + mime_len;
+    size_t head = header_len % 3 ? 3 - header_len % 3 : 0;
+    unsigned char header[32 + 16 + 2];
+    if(head > size)
+        head = size;
+    if(size > UINT32_MAX || (size + header_len + 2) / 3 * 4 > UINT32_MAX - sizeof(PICTURE_FIELD))
+        return OPUSTAGS_INVALID_PICTURE;
+    put_be32(header, 3); // Front cover
+    put_be32(header + 4, mime_len);
+    memcpy(header + 8, mime, mime_len);
+    put_be32(header + 8 + mime_len, 0); // No description
+    put_be32(header + 12 + mime_len, width);
+    put_be32(header + 16 + mime_len, height);
+    put_be32(header + 20 + mime_len, depth);
+    put_be32(header + 24 + mime_len, 0); // Not an indexed picture
+    put_be32(header + 28 + mime_len, size);
+    memcpy(header + header_len, image, head);
+    char *c = malloc(sizeof(PICTURE_FIELD) + (size + header_len + 2) / 3 * 4 + 1), *end;
+    if(c == NULL)
+        return OPUSTAGS_NO_MEMORY;
+    memcpy(c, PICTURE_FIELD "=", sizeof(PICTURE_FIELD));
+    end = b64_encode(header, header_len + head, c + sizeof(PICTURE_FIELD));
+    end = b64_encode(image + head, size - head, end);
+    *end = '\0';
+    *comment = c;
+    return OPUSTAGS_OK;
+}
+
+long render_tags(const opus_tags *tags, unsigned char *data, long size){
+    long len = tags_size(tags) + tags->padding;
+    if(len <= size){
+        tags_cursor c = { .tags = tags };
+        tags_copy(&c, data, len);
+    }
+    return len;
+}
+
+// Start of a phase timed for the stats of a context.
+typedef struct {
+    struct timespec wall, cpu;
+} phase_clock;
+
+static void phase_start(const opustags_context *ctx, phase_clock *c){
+    if(ctx->stats){
+        clock_gettime(CLOCK_MONOTONIC, &c->wall);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c->cpu);
+    }
+}
+
+static uint64_t elapsed_ns(clockid_t clock, const struct timespec *start){
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + now.tv_nsec - start->tv_nsec;
+}
+
+static void phase_stop(opustags_context *ctx, int phase, const phase_clock *c){
+    if(ctx->stats){
+        ctx->stats->wall_ns[phase] += elapsed_ns(CLOCK_MONOTONIC, &c->wall);
+        ctx->stats->cpu_ns[phase] += elapsed_ns(CLOCK_THREAD_CPUTIME_ID, &c->cpu);
+    }
+}
+
+static int write_page(const ogg_page *og, FILE *stream){
+    if(fwrite(og->header, 1, og->header_len, stream) < og->header_len)
+        return -1;
+    if(fwrite(og->body, 1, og->body_len, stream) < og->body_len)
+        return -1;
+    return 0;
+}
+
+// Flush the pages pending in the encoder, adding their size to *written.
+static int flush_pages(ogg_stream_state *enc, FILE *stream, off_t *written){
+    ogg_page og;
+    while(ogg_stream_flush(enc, &og) != 0){
+        if(write_page(&og, stream) == -1)
+            return -1;
+        *written += og.header_len + og.body_len;
+    }
+    return 0;
+}
+
+// Write the comment header as the next pages of the encoder's stream, with 255
+// segments per page. The pages are filled from the tags themselves, so the only
+// copies are the ones made by stdio.
+static int write_tags(const opus_tags *tags, ogg_stream_state *enc, FILE *stream, off_t *written){
+    long size = tags_size(tags) + tags->padding;
+    long segments = size / 255 + 1, done = 0;
+    tags_cursor c = { .tags = tags };
+    unsigned char header[27 + 255];
+    const unsigned char *data;
+    while(done < segments){
+        int count = segments - done > 255 ? 255 : segments - done, i;
+        long body_len = 0, left, n;
+        int last = done + count == segments;
+        uint32_t v;
+        memcpy(header, "OggS", 4);
+        header[4] = 0;
+        header[5] = done > 0 ? 0x01 : 0x00;
+        // Header packets have a granule position of 0, or -1 on pages where they don't end.
+        memset(header + 6, last ? 0x00 : 0xff, 8);
+        v = htole32(enc->serialno);
+        memcpy(header + 14, &v, 4);
+        v = htole32(enc->pageno++);
+        memcpy(header + 18, &v, 4);
+        memset(header + 22, 0, 4);
+        header[26] = count;
+        for(i=0; i<count; i++){
+            header[27 + i] = last && i == count - 1 ? size % 255 : 255;
+            body_len += header[27 + i];
+        }
+        // The checksum goes in the header, so the body is walked twice.
+        tags_cursor start = c;
+        uint32_t crc = page_crc(0, header, 27 + count);
+        for(left = body_len; left > 0; left -= n, c.offset += n){
+            n = tags_chunk(&c, &data);
+            if(n > left)
+                n = left;
+            crc = page_crc(crc, data, n);
+        }
+        v = htole32(crc);
+        memcpy(header + 22, &v, 4);
+        if(fwrite(header, 1, 27 + count, stream) < 27 + count)
+            return -1;
+        c = start;
+        for(left = body_len; left > 0; left -= n, c.offset += n){
+            n = tags_chunk(&c, &data);
+            if(n > left)
+                n = left;
+            if(fwrite(data, 1, n, stream) < n)
+                return -1;
+        }
+        *written += 27 + count + body_len;
+        done += count;
+    }
+    return 0;
+}
+
+int init_context(opustags_context *ctx){
+    ogg_sync_init(&ctx->oy);
+    if(ogg_stream_init(&ctx->os, 0) == -1)
+        return OPUSTAGS_NO_MEMORY;
+    if(ogg_stream_init(&ctx->enc, 0) == -1){
+        ogg_stream_clear(&ctx->os);
+        return OPUSTAGS_NO_MEMORY;
+    }
+    ctx->pages = NULL;
+    ctx->page_capacity = 0;
+    ctx->stats = NULL;
+    return OPUSTAGS_OK;
+}
+
+void free_context(opustags_context *ctx){
+    ogg_stream_clear(&ctx->os);
+    ogg_stream_clear(&ctx->enc);
+    ogg_sync_clear(&ctx->oy);
+    free(ctx->pages);
+}
+
+static int pwrite_all(int fd, const char *buf, size_t len, off_t offset){
+    ssize_t n;
+    while(len > 0){
+        n = pwrite(fd, buf, len, offset);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Find the next page of the mapped data from *offset, skipping garbage as ogg_sync_pageout would.
+// og then points into the mapping. Return 0 when there are no more pages.
+// Unless verify is set, the checksum is trusted and only the page structure is checked.
+static int map_pageout(const unsigned char *map, off_t size, off_t *offset, ogg_page *og, int verify){
+    off_t pos = *offset;
+    while(size - pos >= 27){
+        const unsigned char *page = map + pos;
+        long header_len = 27 + page[26], body_len = 0;
+        if(memcmp(page, "OggS", 4) == 0 && size - pos >= header_len){
+            int i;
+            for(i=0; i<page[26]; i++)
+                body_len += page[27 + i];
+            if(size - pos >= header_len + body_len){
+                // The checksum is computed as if its own field were zero.
+                uint32_t crc = 0;
+                if(verify){
+                    crc = page_crc(0, page, 22);
+                    crc = page_crc(crc, zeros, 4);
+                    crc = page_crc(crc, page + 26, header_len - 26 + body_len);
+                    crc = htole32(crc);
+                }
+                if(!verify || memcmp(&crc, page + 22, 4) == 0){
+                    og->header = (unsigned char*) page;
+                    og->header_len = header_len;
+                    og->body = (unsigned char*) page + header_len;
+                    og->body_len = body_len;
+                    *offset = pos + header_len + body_len;
+                    return 1;
+                }
+            }
+        }
+        const unsigned char *next = memchr(page + 1, 'O', size - pos - 1);
+        if(next == NULL)
+            break;
+        pos = next - map;
+    }
+    *offset = size;
+    return 0;
+}
+
+// Collect in the pages of ctx the pages of a comment header that has them to itself,
+// as RFC 7845 requires, so that it can be parsed where it lies. og is its first page.
+// Return the number of pages, 0 if the header must go through libogg, -1 on error.
+static int map_tags_pages(const unsigned char *map, off_t size, off_t *offset, ogg_page *og, long serialno,
+                          int verify, opustags_context *ctx){
+    int count = 0;
+    for(;;){
+        unsigned char last_lacing = og->header[og->header_len - 1];
+        if(ogg_page_continued(og) != (count > 0) || ogg_page_serialno(og) != serialno || og->header[26] == 0)
+            return 0;
+        if(ogg_page_packets(og) > (last_lacing != 255))
+            return 0;
+        if(count == ctx->page_capacity){
+            int capacity = ctx->page_capacity ? ctx->page_capacity * 2 : 16;
+            ogg_page *grown = realloc(ctx->pages, capacity * sizeof(ogg_page));
+            if(grown == NULL)
+                return -1;
+            ctx->pages = grown;
+            ctx->page_capacity = capacity;
+        }
+        ctx->pages[count++] = *og;
+        if(last_lacing != 255)
+            return count;
+        if(map_pageout(map, size, offset, og, verify) != 1)
+            return 0;
+    }
+}
+
+int rewrite_in_place(opustags_context *ctx, const opustags_edits *edits, int fd,
+                     opustags_inspect *inspect, void *arg, int *rewritten){
+    *rewritten = 0;
+    struct stat st;
+    // Later links are left to edit_file.
+    if(edits->link != 0 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > SIZE_MAX)
+        return OPUSTAGS_OK;
+    const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+        return OPUSTAGS_OK;
+    ogg_page og, *pages;
+    opus_tags tags;
+    phase_clock clock;
+    off_t offset = 0;
+    int count = 0, rc = OPUSTAGS_OK;
+    phase_start(ctx, &clock);
+    // The identification header must be alone on the first page.
+    if(map_pageout(map, st.st_size, &offset, &og, 1) == 1 && og.header[26] != 0 &&
+       og.header[og.header_len - 1] != 255 && ogg_page_packets(&og) == 1){
+        // A file starting with another stream is left to edit_file, as the Opus
+        // stream may come next.
+        long serialno = ogg_page_serialno(&og);
+        if(og.body_len >= 8 && memcmp(og.body, "OpusHead", 8) == 0 &&
+           map_pageout(map, st.st_size, &offset, &og, 1) == 1)
+            count = map_tags_pages(map, st.st_size, &offset, &og, serialno, 1, ctx);
+        if(count == -1)
+            rc = OPUSTAGS_NO_MEMORY;
+    }
+    phase_stop(ctx, OPUSTAGS_PHASE_PAGEOUT, &clock);
+    pages = ctx->pages;
+    if(count > 0 && rc == OPUSTAGS_OK){
+        phase_start(ctx, &clock);
+        rc = parse_tags_pages(pages, count, &tags);
+        phase_stop(ctx, OPUSTAGS_PHASE_PARSE, &clock);
+    }
+    if(count > 0 && rc == OPUSTAGS_OK){
+        // Whatever is left of the old packet becomes the padding, unless it ends
+        // with trailing data, which nothing may follow, or the padding is set
+        // and must then take exactly what is left.
+        long size = tags_size(&tags) + tags.padding;
+        long pad = tags.trailing_data > 0 ? 0 : edits->pad;
+        tags.padding = 0;
+        phase_start(ctx, &clock);
+        rc = edit_tags(&tags, edits);
+        int fits = rc == OPUSTAGS_OK && (pad >= 0 ? tags_size(&tags) + pad == size : tags_size(&tags) <= size);
+        if(fits){
+            tags.padding = size - tags_size(&tags);
+            if(inspect != NULL)
+                inspect(&tags, arg);
+        }
+        phase_stop(ctx, OPUSTAGS_PHASE_EDIT, &clock);
+        if(fits){
+            // The new packet is laid out on the same pages, one at a time. The
+            // strings it is read from are never moved further into the file, so
+            // none of them is overwritten before being copied.
+            tags_cursor c = { .tags = &tags };
+            unsigned char *page = malloc(27 + 255 + 255 * 255);
+            int i;
+            if(page == NULL)
+                rc = OPUSTAGS_NO_MEMORY;
+            for(i=0; i<count && rc == OPUSTAGS_OK; i++){
+                memcpy(page, pages[i].header, pages[i].header_len);
+                og.header = page;
+                og.header_len = pages[i].header_len;
+                og.body = page + og.header_len;
+                og.body_len = pages[i].body_len;
+                phase_start(ctx, &clock);
+                tags_copy(&c, og.body, og.body_len);
+                ogg_page_checksum_set(&og);
+                phase_stop(ctx, OPUSTAGS_PHASE_RENDER, &clock);
+                phase_start(ctx, &clock);
+                if(pwrite_all(fd, (char*) page, og.header_len + og.body_len, pages[i].header - map) == -1)
+                    rc = OPUSTAGS_PARTIAL_WRITE;
+                phase_stop(ctx, OPUSTAGS_PHASE_WRITE, &clock);
+            }
+            free(page);
+            *rewritten = rc == OPUSTAGS_OK;
+            if(*rewritten && ctx->stats){
+                // Only the comment header pages were read and written.
+                opustags_stats *stats = ctx->stats;
+                stats->paths |= OPUSTAGS_PATH_IN_PLACE | OPUSTAGS_PATH_MAPPED | OPUSTAGS_PATH_DIRECT;
+                stats->header_pages += count + 1;
+                stats->bytes_read += offset;
+                stats->bytes_written += offset - (pages[0].header - map);
+                stats->comments += tags.count;
+                stats->header_size += size;
+            }
+        }
+        free_tags(&tags);
+    }
+    munmap((void*) map, st.st_size);
+    return rc;
+}
+
+static int write_all(int fd, const char *buf, size_t len){
+    ssize_t n;
+    while(len > 0){
+        n = write(fd, buf, len);
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write to out, which was flushed, by its file descriptor, or through stdio when
+// it has none, as with memory streams.
+static int write_out(FILE *out, const char *buf, size_t len){
+    int fd = fileno(out);
+    if(fd == -1)
+        return fwrite(buf, 1, len, out) < len ? -1 : 0;
+    return write_all(fd, buf, len);
+}
+
+// Copy in from its current offset to out, passing the data from one file to another in the
+// kernel, and add the number of bytes copied to *copied. Return 1 when done, 0 if the files
+// don't support it, and -1 on error.
+static int kernel_copy(int in, int out, off_t *copied){
+#ifdef __linux__
+    ssize_t n;
+    while((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+        *copied += n;
+    if(n == 0)
+        return 1;
+    if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+        return -1;
+    // Either side may not be a regular file, or they belong to different file systems.
+    while((n = sendfile(out, in, NULL, 1 << 30)) > 0)
+        *copied += n;
+    if(n == 0)
+        return 1;
+    if(errno != EINVAL && errno != ENOSYS)
+        return -1;
+    // Input from a pipe.
+    while((n = splice(in, NULL, out, NULL, 1 << 30, SPLICE_F_MOVE)) > 0)
+        *copied += n;
+    if(n == 0)
+        return 1;
+    if(errno != EINVAL && errno != ENOSYS)
+        return -1;
+#endif
+    return 0;
+}
+
+// Account for the bytes of the tail read from the input and written, when collecting stats.
+static void count_tail(opustags_stats *stats, off_t read, off_t written){
+    if(stats){
+        stats->bytes_read += read;
+        stats->bytes_written += written;
+    }
+}
+
+// Copy what is left of the input to out, starting with the bytes read ahead by oy.
+static int copy_tail(int in, ogg_sync_state *oy, FILE *out, opustags_stats *stats){
+    off_t ahead = oy->fill - oy->returned, copied = 0;
+    if(write_out(out, (char*) oy->data + oy->returned, ahead) == -1)
+        return -1;
+    int rc = 0;
+    if(fileno(out) != -1){
+        rc = kernel_copy(in, fileno(out), &copied);
+        if(stats && copied > 0)
+            stats->paths |= OPUSTAGS_PATH_KERNEL_COPY;
+    }
+    ssize_t n;
+    char buf[65536];
+    while(rc == 0 && (n = read(in, buf, sizeof(buf))) != 0){
+        if(n == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(write_out(out, buf, n) == -1)
+            return -1;
+        copied += n;
+    }
+    count_tail(stats, copied, ahead + copied);
+    return rc == -1 ? -1 : 0;
+}
+
+#ifdef FICLONERANGE
+// Share the data of in from offset onward with out at out_offset, if the file system has
+// reflinks and both offsets are at the same place within a block.
+// Return 1 if the data was cloned, 0 if it must be copied instead, -1 on error.
+static int clone_tail(int in, off_t offset, int out, off_t out_offset, opustags_stats *stats){
+    struct stat st_in, st_out;
+    if(fstat(in, &st_in) == -1 || fstat(out, &st_out) == -1)
+        return -1;
+    off_t block = st_out.st_blksize;
+    if(block <= 0 || block > 65536 || offset % block != out_offset % block)
+        return 0;
+    // Up to the first block boundary, the data must be copied.
+    off_t head = (block - offset % block) % block;
+    if(offset + head >= st_in.st_size)
+        return 0;
+    char buf[65536];
+    if(head > 0){
+        if(pread(in, buf, head, offset) != head)
+            return -1;
+        if(pwrite_all(out, buf, head, out_offset) == -1)
+            return -1;
+    }
+    struct file_clone_range range = {
+        .src_fd = in,
+        .src_offset = offset + head,
+        .src_length = 0, // Up to the end of in.
+        .dest_offset = out_offset + head,
+    };
+    if(ioctl(out, FICLONERANGE, &range) == -1){
+        if(errno != EOPNOTSUPP && errno != ENOTTY && errno != EXDEV && errno != EINVAL)
+            return -1;
+        if(ftruncate(out, out_offset) == -1)
+            return -1;
+        return 0;
+    }
+    count_tail(stats, st_in.st_size - offset, st_in.st_size - offset);
+    if(stats)
+        stats->paths |= OPUSTAGS_PATH_CLONE;
+    return 1;
+}
+
+// Return the block size of out, which must still be empty, if its blocks can be
+// shared with in, or else 0. The first block of in is cloned to find out, then out
+// is truncated again.
+static long clone_block(int in, int out){
+    struct stat st_in, st_out;
+    if(fstat(in, &st_in) == -1 || fstat(out, &st_out) == -1 || !S_ISREG(st_in.st_mode) || st_out.st_size != 0)
+        return 0;
+    long block = st_out.st_blksize;
+    // Nothing would be shared from a file of less than two blocks.
+    if(block <= 0 || block > 65536 || st_in.st_size < 2 * block)
+        return 0;
+    struct file_clone_range range = { .src_fd = in, .src_length = block };
+    if(ioctl(out, FICLONERANGE, &range) == -1)
+        return 0;
+    return ftruncate(out, 0) == 0 ? block : 0;
+}
+#endif
+
+// Size of the pages holding a single packet, with ogg_stream_flush's 255 segments per page.
+static long packet_pages_size(long bytes){
+    long segments = bytes / 255 + 1;
+    return bytes + segments + 27 * ((segments + 254) / 255);
+}
+
+// Copy the mapped input from offset to out, by the kernel if possible, or else straight from
+// the mapping. in is -1 when the input is only in memory.
+static int copy_map_tail(int in, const unsigned char *map, off_t size, off_t offset, FILE *out,
+                         opustags_stats *stats){
+    count_tail(stats, size - offset, size - offset);
+    if(in != -1 && fileno(out) != -1){
+        if(lseek(in, offset, SEEK_SET) == -1)
+            return -1;
+        off_t moved = 0;
+        int rc = kernel_copy(in, fileno(out), &moved);
+        if(stats && moved > 0)
+            stats->paths |= OPUSTAGS_PATH_KERNEL_COPY;
+        if(rc != 0)
+            return rc;
+        // The kernel copy may have stopped midway.
+        if((offset = lseek(in, 0, SEEK_CUR)) == -1)
+            return -1;
+    }
+    return write_out(out, (const char*) map + offset, size - offset);
+}
+
+// Write og with its sequence number shifted by delta if it belongs to serialno.
+static int write_tail_page(const ogg_page *og, long serialno, long delta, FILE *stream){
+    unsigned char header[282];
+    uint32_t v;
+    if(ogg_page_serialno(og) != serialno)
+        return write_page(og, stream);
+    memcpy(header, og->header, og->header_len);
+    v = htole32(ogg_page_pageno(og) + delta);
+    memcpy(header + 18, &v, 4);
+    // The checksum is linear, so it is patched with the checksum of the change to the
+    // sequence number alone, without going through the page again. A page that was
+    // corrupted stays so.
+    unsigned char change[4];
+    int i;
+    for(i=0; i<4; i++)
+        change[i] = header[18 + i] ^ og->header[18 + i];
+    uint32_t crc = crc_zeros(page_crc(0, change, 4), og->header_len + og->body_len - 22);
+    memcpy(&v, og->header + 22, 4);
+    v = htole32(le32toh(v) ^ crc);
+    memcpy(header + 22, &v, 4);
+    if(fwrite(header, 1, og->header_len, stream) < og->header_len)
+        return -1;
+    if(fwrite(og->body, 1, og->body_len, stream) < og->body_len)
+        return -1;
+    return 0;
+}
+
+// Copy the rest of the stream, from the mapping when there is one, shifting the
+// sequence numbers of the pages of serialno by delta. Anything found between the
+// pages is copied as is. Pipes are always checked by libogg, while the checksums
+// of mapped pages are only verified if verify is set.
+static int renumber_tail(int in, ogg_sync_state *oy, const unsigned char *map, off_t size, off_t offset,
+                         long serialno, long delta, int verify, FILE *stream, opustags_stats *stats){
+    ogg_page og;
+    if(stats)
+        stats->paths |= OPUSTAGS_PATH_RENUMBER;
+    if(map != NULL){
+        off_t end = offset, start;
+        count_tail(stats, size - offset, size - offset);
+        while(map_pageout(map, size, &offset, &og, verify) == 1){
+            if(stats)
+                stats->tail_pages++;
+            start = og.header - map;
+            if(start > end && fwrite(map + end, 1, start - end, stream) < start - end)
+                return -1;
+            if(write_tail_page(&og, serialno, delta, stream) == -1)
+                return -1;
+            end = offset;
+        }
+        if(size > end && fwrite(map + end, 1, size - end, stream) < size - end)
+            return -1;
+        return fflush(stream) == EOF ? -1 : 0;
+    }
+    off_t read_len = 0, written = 0;
+    for(;;){
+        long n = ogg_sync_pageseek(oy, &og);
+        if(n < 0){
+            if(fwrite(oy->data + oy->returned + n, 1, -n, stream) < -n)
+                return -1;
+            written += -n;
+            continue;
+        }
+        if(n > 0){
+            if(write_tail_page(&og, serialno, delta, stream) == -1)
+                return -1;
+            written += n;
+            if(stats)
+                stats->tail_pages++;
+            continue;
+        }
+        char *buf = ogg_sync_buffer(oy, 65536);
+        if(buf == NULL){
+            errno = ENOMEM;
+            return -1;
+        }
+        ssize_t len = read(in, buf, 65536);
+        if(len == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(len == 0)
+            break;
+        read_len += len;
+        ogg_sync_wrote(oy, len);
+    }
+    // An incomplete last page.
+    if(fwrite(oy->data + oy->returned, 1, oy->fill - oy->returned, stream) < oy->fill - oy->returned)
+        return -1;
+    count_tail(stats, read_len, written + oy->fill - oy->returned);
+    return fflush(stream) == EOF ? -1 : 0;
+}
+
+// Copy len bytes of the mapped input from offset to out, by the kernel when it's
+// worth it. in is -1 when the input is only in memory.
+static int copy_range(int in, const unsigned char *map, off_t offset, off_t len, FILE *out){
+#ifdef __linux__
+    if(in != -1 && fileno(out) != -1 && len >= 65536){
+        if(fflush(out) == EOF)
+            return -1;
+        loff_t off = offset;
+        ssize_t n = 0;
+        while(len > 0 && (n = copy_file_range(in, &off, fileno(out), NULL, len, 0)) > 0)
+            len -= n;
+        if(n == -1 && errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+            return -1;
+        offset = off;
+    }
+#endif
+    return fwrite(map + offset, 1, len, out) < len ? -1 : 0;
+}
+
+// Copy the pages of the current link of a chained stream to out, unless it is NULL, up
+// to the first page of the next link, shifting the sequence numbers of the pages of
+// serialno by delta. bos tells whether the last page was the first of a stream, as the
+// first pages of all the streams of a link come together. Return 1 when the next link
+// starts, with og set to its first page, 0 at the end of the input, or -1 on error.
+// The pages are only copied, so their checksums aren't verified.
+static int copy_link(int in, ogg_sync_state *oy, const unsigned char *map, off_t size, off_t *offset,
+                     ogg_page *og, long serialno, long delta, int bos, FILE *out, off_t *written,
+                     opustags_stats *stats){
+    if(map != NULL){
+        off_t start = *offset, page;
+        int found = 0;
+        while(!found && map_pageout(map, size, offset, og, 0) == 1){
+            page = og->header - map;
+            found = ogg_page_bos(og) && !bos;
+            bos = ogg_page_bos(og);
+            if(stats && !found)
+                stats->tail_pages++;
+            if(found || (delta != 0 && ogg_page_serialno(og) == serialno)){
+                // Whatever lies before the page goes as is.
+                if(out && copy_range(in, map, start, page - start, out) == -1)
+                    return -1;
+                *written += page - start;
+                start = *offset;
+                if(!found && out && write_tail_page(og, serialno, delta, out) == -1)
+                    return -1;
+                *written += found ? 0 : og->header_len + og->body_len;
+            }
+        }
+        if(!found){
+            if(out && copy_range(in, map, start, size - start, out) == -1)
+                return -1;
+            *written += size - start;
+        }
+        return found;
+    }
+    for(;;){
+        long n = ogg_sync_pageseek(oy, og);
+        if(n < 0){
+            if(out && fwrite(oy->data + oy->returned + n, 1, -n, out) < -n)
+                return -1;
+            *written += -n;
+            continue;
+        }
+        if(n > 0){
+            if(ogg_page_bos(og) && !bos)
+                return 1;
+            bos = ogg_page_bos(og);
+            if(stats)
+                stats->tail_pages++;
+            if(out && (delta != 0 ? write_tail_page(og, serialno, delta, out) : write_page(og, out)) == -1)
+                return -1;
+            *written += n;
+            continue;
+        }
+        char *buf = ogg_sync_buffer(oy, 65536);
+        if(buf == NULL){
+            errno = ENOMEM;
+            return -1;
+        }
+        ssize_t len = read(in, buf, 65536);
+        if(len == -1){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        if(len == 0)
+            break;
+        *offset += len;
+        ogg_sync_wrote(oy, len);
+    }
+    // An incomplete last page.
+    if(out && fwrite(oy->data + oy->returned, 1, oy->fill - oy->returned, out) < oy->fill - oy->returned)
+        return -1;
+    *written += oy->fill - oy->returned;
+    return 0;
+}
+
+// Edit the tags and pass them to inspect, then write them as the next pages of enc
+// unless out is NULL.
+static int process_tags(opustags_context *ctx, const opustags_edits *edits, opus_tags *tags, FILE *out,
+                        off_t *header_size, long out_block, off_t audio_offset,
+                        opustags_inspect *inspect, void *arg){
+    ogg_stream_state *enc = &ctx->enc;
+    phase_clock clock;
+    phase_start(ctx, &clock);
+    int rc = edit_tags(tags, edits);
+    if(rc == OPUSTAGS_OK && out == NULL)
+        rc = keep_tags(tags, edits->to_get, edits->count_get);
+    if(rc == OPUSTAGS_OK && inspect != NULL)
+        inspect(tags, arg);
+    phase_stop(ctx, OPUSTAGS_PHASE_EDIT, &clock);
+    if(rc != OPUSTAGS_OK)
+        return rc;
+    if(ctx->stats)
+        ctx->stats->comments += tags->count;
+    if(out == NULL){
+        if(ctx->stats)
+            ctx->stats->header_size += tags_size(tags) + tags->padding;
+        return OPUSTAGS_OK;
+    }
+    // Padding would become part of the trailing data.
+    if(edits->pad >= 0 && tags->trailing_data == 0)
+        tags->padding = edits->pad;
+    // The identification header goes first, if it's still pending.
+    phase_start(ctx, &clock);
+    rc = flush_pages(enc, out, header_size);
+    phase_stop(ctx, OPUSTAGS_PHASE_WRITE, &clock);
+    if(rc == -1)
+        return OPUSTAGS_ERRNO;
+    if(out_block > 0 && tags->trailing_data == 0){
+        // Pad the header so that the audio keeps its position within a block.
+        // File systems with reflinks can then share it with the original file.
+        long size = tags_size(tags), padding;
+        for(padding = tags->padding; padding < tags->padding + 2 * out_block; padding++){
+            if((*header_size + packet_pages_size(size + padding)) % out_block == audio_offset % out_block){
+                tags->padding = padding;
+                break;
+            }
+        }
+    }
+    if(ctx->stats)
+        ctx->stats->header_size += tags_size(tags) + tags->padding;
+    phase_start(ctx, &clock);
+    rc = write_tags(tags, enc, out, header_size);
+    phase_stop(ctx, OPUSTAGS_PHASE_RENDER, &clock);
+    return rc == -1 ? OPUSTAGS_ERRNO : OPUSTAGS_OK;
+}
+
+// Edit the stream read from in, or held in data when it is not NULL.
+static int edit_stream(opustags_context *ctx, const opustags_edits *edits, int in, const unsigned char *data,
+                       off_t size, FILE *out, int flags, opustags_inspect *inspect, void *arg){
+    // The audio is only aligned for the file system to share it when it can, and
+    // the padding isn't set.
+    long out_block = 0;
+#ifdef FICLONERANGE
+    if(out && (flags & OPUSTAGS_CLONE) && in != -1 && edits->pad < 0 && fflush(out) == 0)
+        out_block = clone_block(in, fileno(out));
+#endif
+    ogg_sync_state *oy = &ctx->oy;
+    ogg_stream_state *os = &ctx->os, *enc = &ctx->enc;
+    ogg_page og;
+    ogg_packet op;
+    opus_tags tags;
+    opustags_stats *stats = ctx->stats;
+    phase_clock clock;
+    ogg_sync_reset(oy);
+    char *buf;
+    ssize_t len;
+    int rc = OPUSTAGS_OK;
+    int packet_count = -1;
+    int eof = 0, direct = 0;
+    // The current link of a chained stream, counted from 0, and whether its tags are
+    // edited. pending is set when og holds the next page already, and bos when the
+    // last page was the first of a stream. done is set once the end was copied.
+    int link = -1, edited = 0, pending = 0, bos = 0, done = 0;
+    // Offset in the input of the next page, and size of the output so far.
+    off_t read_offset = 0, audio_offset = 0, header_size = 0;
+    // Regular files are mapped in memory, and their pages are used from there.
+    // When only listing the tags, they are probed with small reads instead, as
+    // the headers usually fit in the first few kilobytes. Yet a listing of a few
+    // fields is parsed from the mapping without verifying the checksums, so that
+    // the bodies of the other comments, such as pictures, are never read.
+    const unsigned char *map = data;
+    struct stat st_in;
+    size_t chunk = 65536;
+    int probe = 0;
+    int regular = map == NULL && fstat(in, &st_in) == 0 && S_ISREG(st_in.st_mode);
+    int lazy = regular && !out && (flags & OPUSTAGS_LAZY);
+    if(regular && !out && !lazy && edits->link == 0){
+        probe = 1;
+        chunk = 4096;
+        posix_fadvise(in, 0, 0, POSIX_FADV_RANDOM);
+    }
+    else if(regular && st_in.st_size > 0 && st_in.st_size <= SIZE_MAX){
+        size = st_in.st_size;
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, in, 0);
+        if(map == MAP_FAILED)
+            map = NULL;
+        else
+            madvise((void*) map, size, out || edits->link != 0 ? MADV_SEQUENTIAL : MADV_RANDOM);
+    }
+    if(stats && map != NULL && map != data)
+        stats->paths |= OPUSTAGS_PATH_MAPPED;
+    while(rc == OPUSTAGS_OK){
+        // Read until we complete a page.
+        if(pending)
+            pending = 0;
+        else{
+            phase_start(ctx, &clock);
+            int got = map != NULL ? map_pageout(map, size, &read_offset, &og, 1) : ogg_sync_pageout(oy, &og);
+            phase_stop(ctx, OPUSTAGS_PHASE_PAGEOUT, &clock);
+            if(got != 1){
+                if(map != NULL || eof)
+                    break;
+                buf = ogg_sync_buffer(oy, chunk);
+                if(buf == NULL){
+                    rc = OPUSTAGS_NO_MEMORY;
+                    break;
+                }
+                phase_start(ctx, &clock);
+                len = read(in, buf, chunk);
+                phase_stop(ctx, OPUSTAGS_PHASE_READ, &clock);
+                if(len == -1){
+                    if(errno == EINTR)
+                        continue;
+                    rc = OPUSTAGS_ERRNO;
+                    break;
+                }
+                if(len == 0)
+                    eof = 1;
+                read_offset += len;
+                // Only read more when the comment header spans further pages.
+                if(probe && chunk < 65536)
+                    chunk *= 2;
+                ogg_sync_wrote(oy, len);
+                if(ogg_sync_check(oy) != 0)
+                    rc = OPUSTAGS_INTERNAL;
+                continue;
+            }
+        }
+        // We got a page.
+        if(stats)
+            stats->header_pages++;
+        // A link starts with the first pages of its streams, one of which must be an
+        // Opus stream. The pages of the other streams are copied as they are.
+        if(ogg_page_bos(&og) || link == -1){
+            if(!bos){
+                link++;
+                edited = edits->link == OPUSTAGS_ALL_LINKS || edits->link == link;
+                packet_count = -1;
+                direct = 0;
+            }
+            bos = ogg_page_bos(&og);
+            if(!edited){
+                // A link before the one to edit.
+                if(out && write_page(&og, out) == -1){
+                    rc = OPUSTAGS_ERRNO;
+                    break;
+                }
+                header_size += og.header_len + og.body_len;
+                phase_start(ctx, &clock);
+                int found = copy_link(in, oy, map, size, &read_offset, &og, 0, 0, bos, out, &header_size, stats);
+                phase_stop(ctx, OPUSTAGS_PHASE_TAIL, &clock);
+                if(found == -1)
+                    rc = OPUSTAGS_ERRNO;
+                else if(found == 0)
+                    break;
+                pending = 1;
+                bos = 0;
+                continue;
+            }
+            if(packet_count == -1 && og.body_len >= 8 && memcmp(og.body, "OpusHead", 8) == 0){
+                // Initialize the streams.
+                if(ogg_stream_reset_serialno(os, ogg_page_serialno(&og)) == -1){
+                    rc = OPUSTAGS_INTERNAL;
+                    break;
+                }
+                if(out){
+                    if(ogg_stream_reset_serialno(enc, ogg_page_serialno(&og)) == -1){
+                        rc = OPUSTAGS_INTERNAL;
+                        break;
+                    }
+                }
+                packet_count = 0;
+            }
+            else if(!bos){
+                rc = OPUSTAGS_INVALID_HEADER;
+                break;
+            }
+        }
+        else{
+            bos = 0;
+            if(packet_count == -1){
+                rc = OPUSTAGS_INVALID_HEADER;
+                break;
+            }
+        }
+        if(ogg_page_serialno(&og) != os->serialno || packet_count == -1){
+            if(out && write_page(&og, out) == -1)
+                rc = OPUSTAGS_ERRNO;
+            header_size += og.header_len + og.body_len;
+            continue;
+        }
+        // In a mapped file, the comment header is parsed where it lies, instead
+        // of being gathered in memory by libogg.
+        if(map != NULL && packet_count == 1 && !direct){
+            direct = 1;
+            off_t page_offset = read_offset - og.header_len - og.body_len;
+            phase_start(ctx, &clock);
+            int count = map_tags_pages(map, size, &read_offset, &og, os->serialno, !lazy, ctx);
+            phase_stop(ctx, OPUSTAGS_PHASE_PAGEOUT, &clock);
+            if(count == -1){
+                rc = OPUSTAGS_NO_MEMORY;
+                break;
+            }
+            if(count == 0){
+                // The page is read again, and counted then.
+                if(stats)
+                    stats->header_pages--;
+                read_offset = page_offset;
+                continue;
+            }
+            packet_count = 2;
+            if(stats){
+                stats->header_pages += count - 1;
+                stats->paths |= OPUSTAGS_PATH_DIRECT;
+            }
+            phase_start(ctx, &clock);
+            rc = parse_tags_pages(ctx->pages, count, &tags);
+            phase_stop(ctx, OPUSTAGS_PHASE_PARSE, &clock);
+            if(rc != OPUSTAGS_OK)
+                break;
+            audio_offset = read_offset;
+            rc = process_tags(ctx, edits, &tags, out, &header_size, out_block, audio_offset, inspect, arg);
+            free_tags(&tags);
+        }
+        else{
+            phase_start(ctx, &clock);
+            int paged = ogg_stream_pagein(os, &og);
+            phase_stop(ctx, OPUSTAGS_PHASE_PAGEOUT, &clock);
+            if(paged == -1){
+                rc = OPUSTAGS_INVALID_FILE;
+                break;
+            }
+            // Read all the packets.
+            while(ogg_stream_packetout(os, &op) == 1){
+                packet_count++;
+                if(packet_count == 1){ // Identification header
+                    if(op.bytes < 8 || strncmp((char*) op.packet, "OpusHead", 8) != 0){
+                        rc = OPUSTAGS_INVALID_HEADER;
+                        break;
+                    }
+                }
+                else if(packet_count == 2){ // Comment header
+                    phase_start(ctx, &clock);
+                    rc = parse_tags((char*) op.packet, op.bytes, &tags);
+                    phase_stop(ctx, OPUSTAGS_PHASE_PARSE, &clock);
+                    if(rc != OPUSTAGS_OK)
+                        break;
+                    audio_offset = map ? read_offset : read_offset - (oy->fill - oy->returned);
+                    rc = process_tags(ctx, edits, &tags, out, &header_size, out_block, audio_offset, inspect, arg);
+                    free_tags(&tags);
+                    if(rc != OPUSTAGS_OK || !out)
+                        break;
+                    else
+                        continue;
+                }
+                if(out){
+                    if(ogg_stream_packetin(enc, &op) == -1){
+                        rc = OPUSTAGS_INTERNAL;
+                        break;
+                    }
+                }
+            }
+            if(rc != OPUSTAGS_OK)
+                break;
+            if(ogg_stream_check(os) != 0)
+                rc = OPUSTAGS_INTERNAL;
+            // Write the page.
+            if(out){
+                phase_start(ctx, &clock);
+                int flushed = flush_pages(enc, out, &header_size);
+                phase_stop(ctx, OPUSTAGS_PHASE_WRITE, &clock);
+                if(flushed == -1)
+                    rc = OPUSTAGS_ERRNO;
+                else if(ogg_stream_check(enc) != 0)
+                    rc = OPUSTAGS_INTERNAL;
+            }
+        }
+        // Short-circuit when the relevant packets have been read, unless the
+        // tags of every link are edited.
+        if(rc != OPUSTAGS_OK || packet_count < 2)
+            continue;
+        if(edits->link != OPUSTAGS_ALL_LINKS)
+            break;
+        long delta = out ? enc->pageno - (ogg_page_pageno(&og) + 1) : 0;
+        phase_start(ctx, &clock);
+        int found = copy_link(in, oy, map, size, &read_offset, &og, os->serialno, delta, 0, out, &header_size, stats);
+        phase_stop(ctx, OPUSTAGS_PHASE_TAIL, &clock);
+        if(found == -1)
+            rc = OPUSTAGS_ERRNO;
+        else if(found == 0)
+            done = 1;
+        pending = 1;
+        if(done)
+            break;
+    }
+    // The rest of the stream is copied verbatim, unless the comment header now
+    // takes a different number of pages and the later ones must be renumbered.
+    if(stats)
+        count_tail(stats, read_offset, out ? header_size : 0);
+    if(rc == OPUSTAGS_OK && out && packet_count >= 2 && !done){
+        long delta = enc->pageno - (ogg_page_pageno(&og) + 1);
+        int cloned = 0;
+        phase_start(ctx, &clock);
+        if(delta != 0){
+            if(renumber_tail(in, oy, map, map ? size : 0, read_offset, enc->serialno, delta, !edits->no_verify_tail, out,
+                             stats) == -1)
+                rc = OPUSTAGS_ERRNO;
+        }
+        else{
+            if(fflush(out) == EOF)
+                rc = OPUSTAGS_ERRNO;
+#ifdef FICLONERANGE
+            else if(out_block > 0 && (cloned = clone_tail(in, audio_offset, fileno(out), header_size, stats)) == -1)
+                rc = OPUSTAGS_ERRNO;
+#endif
+            if(rc == OPUSTAGS_OK && !cloned){
+                int copied;
+                if(map != NULL)
+                    copied = copy_map_tail(in, map, size, read_offset, out, stats);
+                else
+                    copied = copy_tail(in, oy, out, stats);
+                if(copied == -1)
+                    rc = OPUSTAGS_ERRNO;
+            }
+        }
+        phase_stop(ctx, OPUSTAGS_PHASE_TAIL, &clock);
+    }
+    if(map != NULL && map != data)
+        munmap((void*) map, size);
+    // Don't let a scan of a whole library fill the page cache.
+    if(regular && !out && !(flags & OPUSTAGS_KEEP_CACHE))
+        posix_fadvise(in, 0, read_offset, POSIX_FADV_DONTNEED);
+    if(rc == OPUSTAGS_OK && !edited)
+        rc = link == -1 ? OPUSTAGS_INVALID_FILE : OPUSTAGS_NO_LINK;
+    else if(rc == OPUSTAGS_OK && packet_count < 2)
+        rc = OPUSTAGS_INVALID_FILE;
+    return rc;
+}
+
+int edit_file(opustags_context *ctx, const opustags_edits *edits, int in, FILE *out, int flags,
+              opustags_inspect *inspect, void *arg){
+    return edit_stream(ctx, edits, in, NULL, 0, out, flags, inspect, arg);
+}
+
+int edit_buffer(opustags_context *ctx, const opustags_edits *edits, const unsigned char *data, size_t size,
+                FILE *out, opustags_inspect *inspect, void *arg){
+    if(data == NULL || size == 0 || size > (uintmax_t) INTMAX_MAX)
+        return OPUSTAGS_INVALID_FILE;
+    return edit_stream(ctx, edits, -1, data, size, out, 0, inspect, arg);
+}
@@ -1,200 +1,2465 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
-#include <ogg/ogg.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "opustags.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define OPUSTAGS_URING
+#endif
+#endif
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+// Escapes a string for JSON over several calls, as comments may be split across
+// pages. Invalid UTF-8 is replaced with U+FFFD.
+typedef struct {
+    int need;
+    unsigned char lo, hi;
+    unsigned char seq[4];
+    int len;
+} json_escaper;
+
+// End the string, replacing an incomplete character.
+void json_end(json_escaper *e, FILE *out){
+    if(e->len > 0)
+        fputs("\\ufffd", out);
+    e->need = 0;
+    e->len = 0;
+}
+
+void json_write(json_escaper *e, const unsigned char *s, long len, FILE *out){
+    long i;
+    for(i=0; i<len; i++){
+        unsigned char c = s[i];
+        if(e->need > 0){
+            if(c >= e->lo && c <= e->hi){
+                e->seq[e->len++] = c;
+                e->lo = 0x80;
+                e->hi = 0xbf;
+                if(--e->need == 0){
+                    fwrite(e->seq, 1, e->len, out);
+                    e->len = 0;
+                }
+                continue;
+            }
+            json_end(e, out);
+        }
+        if(c == '"' || c == '\\'){
+            putc_unlocked('\\', out);
+            putc_unlocked(c, out);
+        }
+        else if(c == '\n')
+            fputs("\\n", out);
+        else if(c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else if(c < 0x80)
+            putc_unlocked(c, out);
+        else{
+            // Overlong forms, surrogates and code points past U+10FFFF are invalid.
+            e->lo = 0x80;
+            e->hi = 0xbf;
+            if(c >= 0xc2 && c <= 0xdf)
+                e->need = 1;
+            else if(c >= 0xe0 && c <= 0xef){
+                e->need = 2;
+                if(c == 0xe0)
+                    e->lo = 0xa0;
+                else if(c == 0xed)
+                    e->hi = 0x9f;
+            }
+            else if(c >= 0xf0 && c <= 0xf4){
+                e->need = 3;
+                if(c == 0xf0)
+                    e->lo = 0x90;
+                else if(c == 0xf4)
+                    e->hi = 0x8f;
+            }
+            else{
+                fputs("\\ufffd", out);
+                continue;
+            }
+            e->seq[0] = c;
+            e->len = 1;
+        }
+    }
+}
+
+// Write comment i of tags, or pass it to the JSON escaper e.
+void print_comment(const opus_tags *tags, uint32_t i, json_escaper *e, FILE *out){
+    const char *data;
+    long offset, n;
+    for(offset = 0; offset < tags->lengths[i]; offset += n){
+        n = tags_span(tags, tags->comment[i], tags->lengths[i], offset, &data);
+        if(e)
+            json_write(e, (const unsigned char*) data, n, out);
+        else
+            fwrite(data, 1, n, out);
+    }
+}
+
+// One line per file: {"file":PATH,"tags":[COMMENT,...]}
+// link is the number of the link of a chained stream the tags come from, or 0.
+void print_tags_json(const opus_tags *tags, const char *path, int link, FILE *out){
+    json_escaper e = { 0 };
+    uint32_t i;
+    fputs("{\"file\":\"", out);
+    json_write(&e, (const unsigned char*) path, strlen(path), out);
+    json_end(&e, out);
+    if(link > 0)
+        fprintf(out, "\",\"link\":%d,\"tags\":[", link);
+    else
+        fputs("\",\"tags\":[", out);
+    for(i=0; i<tags->count; i++){
+        fputs(i == 0 ? "\"" : ",\"", out);
+        print_comment(tags, i, &e, out);
+        json_end(&e, out);
+        putc_unlocked('"', out);
+    }
+    fputs("]}\n", out);
+}
+
+// PATH, each comment, then an empty field, all NUL-terminated.
+void print_tags_nul(const opus_tags *tags, const char *path, FILE *out){
+    uint32_t i;
+    fputs(path, out);
+    putc_unlocked('\0', out);
+    for(i=0; i<tags->count; i++){
+        print_comment(tags, i, NULL, out);
+        putc_unlocked('\0', out);
+    }
+    putc_unlocked('\0', out);
+}
+
+void print_tags(const opus_tags *tags, FILE *out){
+    if(tags->count == 0)
+        fputs("no tags\n", out);
+    uint32_t i;
+    for(i=0; i<tags->count; i++){
+        print_comment(tags, i, NULL, out);
+        putc_unlocked('\n', out);
+    }
+}
+
+// Read the image at path into a new cover art comment, or return NULL on error.
+char *import_picture(const char *path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if(fd != -1)
+            close(fd);
+        return NULL;
+    }
+    if(!S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > SIZE_MAX){
+        fprintf(stderr, "%s: not a picture file\n", path);
+        close(fd);
+        return NULL;
+    }
+    // The image is encoded straight from the mapping.
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    madvise(image, st.st_size, MADV_SEQUENTIAL);
+    char *comment;
+    int rc = make_picture(image, st.st_size, &comment);
+    munmap(image, st.st_size);
+    if(rc != OPUSTAGS_OK)
+        fprintf(stderr, "%s: %s\n", path, opustags_strerror(rc));
+    return comment;
+}
+
+const char *version = "opustags version 1.1\n";
+
+const char *usage =
+    "Usage: opustags --help\n"
+    "       opustags [OPTIONS] FILE...\n"
+    "       opustags OPTIONS FILE -o FILE\n"
+    "       opustags --serve SOCKET\n"
+    "       opustags --manifest FILE\n";
+
+const char *help =
+    "Options:\n"
+    "  -h, --help              print this help\n"
+    "  -o, --output            write the modified tags to a file\n"
+    "  -i, --in-place [SUFFIX] use a temporary file then replace the original file\n"
+    "  -y, --overwrite         overwrite the output file if it already exists\n"
+    "  -d, --delete FIELD      delete all the fields of a specified type\n"
+    "  -a, --add FIELD=VALUE   add a field\n"
+    "  -s, --set FIELD=VALUE   delete then add a field\n"
+    "  -D, --delete-all        delete all the fields!\n"
+    "  -S, --set-all           read the fields from stdin\n"
+    "      --files0-from FILE  read NUL-separated input file names from FILE\n"
+    "  -j, --jobs N            process N files at the same time\n"
+    "  -r, --recursive         list or edit the Ogg files found in directories\n"
+    "      --pad BYTES         reserve space after the tags for later edits\n"
+    "      --set-all-max BYTES   maximum size of the fields read by -S\n"
+    "      --no-verify-tail    trust the checksums of the audio pages\n"
+    "      --serve SOCKET      answer the requests sent to a Unix socket\n"
+    "      --format FORMAT     list the tags as text, json or nul records\n"
+    "      --get FIELD         list only the fields of a specified type\n"
+    "      --manifest FILE     apply the requests read from FILE\n"
+    "      --cache FILE        keep the tags of the files listed or edited in FILE\n"
+    "      --io-uring DEPTH    read up to DEPTH files at the same time per job\n"
+    "      --durability MODE   sync the edited files: none, file or batch\n"
+    "      --link N            edit the Nth link of a chained stream, or all of them\n"
+    "      --export-picture FILE   write the cover art to FILE instead of the tags\n"
+    "      --import-picture FILE   replace the cover art with the image in FILE\n"
+    "      --stats             report the work done on each file to stderr\n";
+
+enum {
+    OPT_FILES0_FROM = 256,
+    OPT_PAD,
+    OPT_SET_ALL_MAX,
+    OPT_NO_VERIFY_TAIL,
+    OPT_SERVE,
+    OPT_FORMAT,
+    OPT_GET,
+    OPT_MANIFEST,
+    OPT_CACHE,
+    OPT_IO_URING,
+    OPT_DURABILITY,
+    OPT_LINK,
+    OPT_EXPORT_PICTURE,
+    OPT_IMPORT_PICTURE,
+    OPT_STATS,
+};
+
+enum {
+    DURABILITY_NONE,
+    DURABILITY_FILE,
+    DURABILITY_BATCH,
+};
+
+enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_NUL,
+};
+
+struct option options[] = {
+    {"help", no_argument, 0, 'h'},
+    {"output", required_argument, 0, 'o'},
+    {"in-place", optional_argument, 0, 'i'},
+    {"overwrite", no_argument, 0, 'y'},
+    {"delete", required_argument, 0, 'd'},
+    {"add", required_argument, 0, 'a'},
+    {"set", required_argument, 0, 's'},
+    {"delete-all", no_argument, 0, 'D'},
+    {"set-all", no_argument, 0, 'S'},
+    {"files0-from", required_argument, 0, OPT_FILES0_FROM},
+    {"jobs", required_argument, 0, 'j'},
+    {"recursive", no_argument, 0, 'r'},
+    {"pad", required_argument, 0, OPT_PAD},
+    {"set-all-max", required_argument, 0, OPT_SET_ALL_MAX},
+    {"no-verify-tail", no_argument, 0, OPT_NO_VERIFY_TAIL},
+    {"serve", required_argument, 0, OPT_SERVE},
+    {"format", required_argument, 0, OPT_FORMAT},
+    {"get", required_argument, 0, OPT_GET},
+    {"manifest", required_argument, 0, OPT_MANIFEST},
+    {"cache", required_argument, 0, OPT_CACHE},
+    {"io-uring", required_argument, 0, OPT_IO_URING},
+    {"durability", required_argument, 0, OPT_DURABILITY},
+    {"link", required_argument, 0, OPT_LINK},
+    {"export-picture", required_argument, 0, OPT_EXPORT_PICTURE},
+    {"import-picture", required_argument, 0, OPT_IMPORT_PICTURE},
+    {"stats", no_argument, 0, OPT_STATS},
+    {NULL, 0, 0, 0}
+};
+
+// Identity of a file in the --cache. The change time catches the edits that
+// restore the modification time.
+typedef struct {
+    uint64_t dev, ino, size;
+    int64_t mtime, mtime_nsec, ctime, ctime_nsec;
+} cache_key;
+
+// Comments larger than this are left out of the cache, and only their field name
+// is kept, so that cover art doesn't bloat it.
+#define CACHE_COMMENT_MAX 4096
+
+// Tags stored since the cache was loaded: the OpusTags packet of the vendor and
+// the cached comments, preceded by its size as 4 bytes, then an OpusTags packet
+// of the field names of the comments left out.
+typedef struct cache_item {
+    struct cache_item *next;
+    cache_key key;
+    size_t size;
+    unsigned char data[];
+} cache_item;
+
+// The cache file: a header, a hash table of slots, then the data of the entries.
+// Empty slots have a size of 0.
+typedef struct {
+    char magic[8];
+    uint64_t slot_count;
+} cache_header;
+
+typedef struct {
+    cache_key key;
+    uint64_t offset, size;
+} cache_slot;
+
+static const char cache_magic[8] = "OTCACHE1";
+
+typedef struct {
+    const char *path;
+    pthread_mutex_t lock;
+    // The cache file as it was when loaded, mapped read-only.
+    unsigned char *map;
+    size_t map_size;
+    const cache_slot *slots;
+    uint64_t slot_count;
+    // The entries stored since, by file, which replace the older ones.
+    cache_item **table;
+    size_t table_size, table_count;
+    cache_item *items;
+} opustags_cache;
+
+void make_key(const struct stat *st, cache_key *key){
+    memset(key, 0, sizeof(*key));
+    key->dev = st->st_dev;
+    key->ino = st->st_ino;
+    key->size = st->st_size;
+    key->mtime = st->st_mtim.tv_sec;
+    key->mtime_nsec = st->st_mtim.tv_nsec;
+    key->ctime = st->st_ctim.tv_sec;
+    key->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+uint64_t hash_key(const cache_key *key){
+    uint64_t h = key->dev * 0x9e3779b97f4a7c15 ^ key->ino;
+    h = (h ^ h >> 31) * 0xbf58476d1ce4e5b9;
+    return h ^ h >> 29;
+}
+
+int same_file(const cache_key *a, const cache_key *b){
+    return a->dev == b->dev && a->ino == b->ino;
+}
+
+// Map the cache file at path, if any. A file that isn't a cache is replaced
+// when saving.
+int load_cache(opustags_cache *cache, const char *path){
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    pthread_mutex_init(&cache->lock, NULL);
+    int fd = open(path, O_RDONLY);
+    if(fd == -1){
+        if(errno == ENOENT)
+            return 0;
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    if(st.st_size >= sizeof(cache_header)){
+        cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(cache->map == MAP_FAILED){
+            perror(path);
+            cache->map = NULL;
+            close(fd);
+            return -1;
+        }
+        cache->map_size = st.st_size;
+    }
+    close(fd);
+    if(cache->map != NULL){
+        const cache_header *header = (const cache_header*) cache->map;
+        uint64_t n = header->slot_count;
+        if(memcmp(header->magic, cache_magic, sizeof(cache_magic)) == 0 && n > 0 && (n & (n - 1)) == 0 &&
+           n <= (cache->map_size - sizeof(cache_header)) / sizeof(cache_slot)){
+            cache->slots = (const cache_slot*) (cache->map + sizeof(cache_header));
+            cache->slot_count = n;
+        }
+    }
+    if(cache->slots == NULL && st.st_size > 0)
+        fprintf(stderr, "warning: %s isn't a cache of opustags; it will be replaced\n", path);
+    return 0;
+}
+
+// Find the tags of the file identified by key, and point *data to them.
+// Return their size, or 0 if they aren't cached.
+size_t find_cached(opustags_cache *cache, const cache_key *key, const unsigned char **data){
+    size_t size = 0;
+    uint64_t h = hash_key(key), i, n;
+    pthread_mutex_lock(&cache->lock);
+    if(cache->table_size > 0){
+        for(i = h & (cache->table_size - 1); cache->table[i]; i = (i + 1) & (cache->table_size - 1)){
+            if(same_file(&cache->table[i]->key, key)){
+                if(memcmp(&cache->table[i]->key, key, sizeof(*key)) == 0){
+                    *data = cache->table[i]->data;
+                    size = cache->table[i]->size;
+                }
+                pthread_mutex_unlock(&cache->lock);
+                return size;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    // A damaged file may have no empty slot.
+    for(n = 0, i = h & (cache->slot_count - 1); n < cache->slot_count && cache->slots[i].size;
+        n++, i = (i + 1) & (cache->slot_count - 1)){
+        const cache_slot *slot = &cache->slots[i];
+        if(memcmp(&slot->key, key, sizeof(*key)) == 0){
+            if(slot->offset > cache->map_size || slot->size > cache->map_size - slot->offset)
+                return 0;
+            *data = cache->map + slot->offset;
+            return slot->size;
+        }
+    }
+    return 0;
+}
+
+// Append the OpusTags packet of the vendor and the comments of tags selected by
+// keep to p. Return the end of the packet.
+unsigned char *render_some(const opus_tags *tags, const char *vendor, uint32_t vendor_length, int keep,
+                           const char **comment, uint32_t *lengths, unsigned char *p){
+    opus_tags some = *tags;
+    uint32_t i;
+    some.vendor_string = vendor;
+    some.vendor_length = vendor_length;
+    some.count = 0;
+    some.comment = comment;
+    some.lengths = lengths;
+    some.padding = 0;
+    some.trailing_data = 0;
+    for(i=0; i<tags->count; i++){
+        if((tags->lengths[i] <= CACHE_COMMENT_MAX) != keep)
+            continue;
+        comment[some.count] = tags->comment[i];
+        lengths[some.count] = tags->lengths[i];
+        if(!keep){
+            // Only the field name, which is always contiguous.
+            const char *data, *eq;
+            long n = tags_span(tags, tags->comment[i], tags->lengths[i], 0, &data);
+            eq = memchr(data, '=', n);
+            lengths[some.count] = eq ? eq - data + 1 : 0;
+        }
+        some.count++;
+    }
+    return p + render_tags(&some, p, LONG_MAX);
+}
+
+// Serialize tags for the cache, reading the comments that are kept.
+cache_item *make_item(const opus_tags *tags){
+    // Both packets together are at most 16 bytes and 4 per comment larger than the tags.
+    size_t size = 4 + tags_size(tags) + 16 + tags->count * 4;
+    uint32_t i;
+    cache_item *item = malloc(sizeof(cache_item) + size);
+    const char **comment = malloc(tags->count * sizeof(char*) + 1);
+    uint32_t *lengths = malloc(tags->count * sizeof(uint32_t) + 1);
+    if(item == NULL || comment == NULL || lengths == NULL){
+        free(item);
+        free(comment);
+        free(lengths);
+        return NULL;
+    }
+    unsigned char *p = render_some(tags, tags->vendor_string, tags->vendor_length, 1, comment, lengths, item->data + 4);
+    uint32_t n = p - item->data - 4;
+    for(i=0; i<4; i++)
+        item->data[i] = n >> 8 * i;
+    p = render_some(tags, "", 0, 0, comment, lengths, p);
+    item->size = p - item->data;
+    free(comment);
+    free(lengths);
+    return item;
+}
+
+// Store item as the tags of the file identified by key, which then owns it.
+void store_cached(opustags_cache *cache, const cache_key *key, cache_item *item){
+    uint64_t i;
+    item->key = *key;
+    pthread_mutex_lock(&cache->lock);
+    item->next = cache->items;
+    cache->items = item;
+    if(2 * (cache->table_count + 1) > cache->table_size){
+        size_t size = cache->table_size ? 2 * cache->table_size : 1024, j;
+        cache_item **table = calloc(size, sizeof(cache_item*));
+        if(table == NULL){
+            pthread_mutex_unlock(&cache->lock);
+            return;
+        }
+        for(j=0; j<cache->table_size; j++){
+            if(cache->table[j] == NULL)
+                continue;
+            for(i = hash_key(&cache->table[j]->key) & (size - 1); table[i]; i = (i + 1) & (size - 1));
+            table[i] = cache->table[j];
+        }
+        free(cache->table);
+        cache->table = table;
+        cache->table_size = size;
+    }
+    for(i = hash_key(key) & (cache->table_size - 1); cache->table[i]; i = (i + 1) & (cache->table_size - 1)){
+        if(same_file(&cache->table[i]->key, key))
+            break;
+    }
+    if(cache->table[i] == NULL)
+        cache->table_count++;
+    cache->table[i] = item;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Whether the slot of the cache file is still current.
+int slot_kept(const opustags_cache *cache, const cache_slot *slot){
+    if(slot->size == 0 || slot->offset > cache->map_size || slot->size > cache->map_size - slot->offset)
+        return 0;
+    if(cache->table_size == 0)
+        return 1;
+    uint64_t i;
+    for(i = hash_key(&slot->key) & (cache->table_size - 1); cache->table[i]; i = (i + 1) & (cache->table_size - 1)){
+        if(same_file(&cache->table[i]->key, &slot->key))
+            return 0;
+    }
+    return 1;
+}
+
+void add_slot(cache_slot *slots, uint64_t count, const cache_key *key, uint64_t offset, uint64_t size){
+    uint64_t i;
+    for(i = hash_key(key) & (count - 1); slots[i].size; i = (i + 1) & (count - 1));
+    slots[i].key = *key;
+    slots[i].offset = offset;
+    slots[i].size = size;
+}
+
+// Write the entries of the cache file that weren't replaced along with the new
+// ones to a new cache file, which then replaces the old one.
+int save_cache(opustags_cache *cache){
+    if(cache->table_count == 0)
+        return 0;
+    uint64_t count = cache->table_count, slot_count = 16, offset, i;
+    for(i=0; i<cache->slot_count; i++)
+        count += slot_kept(cache, &cache->slots[i]);
+    while(slot_count < 2 * count)
+        slot_count *= 2;
+    cache_slot *slots = calloc(slot_count, sizeof(cache_slot));
+    if(slots == NULL){
+        fputs("failure to allocate memory for the cache\n", stderr);
+        return -1;
+    }
+    offset = sizeof(cache_header) + slot_count * sizeof(cache_slot);
+    for(i=0; i<cache->slot_count; i++){
+        if(slot_kept(cache, &cache->slots[i])){
+            add_slot(slots, slot_count, &cache->slots[i].key, offset, cache->slots[i].size);
+            offset += cache->slots[i].size;
+        }
+    }
+    for(i=0; i<cache->table_size; i++){
+        if(cache->table[i]){
+            add_slot(slots, slot_count, &cache->table[i]->key, offset, cache->table[i]->size);
+            offset += cache->table[i]->size;
+        }
+    }
+    size_t size = strlen(cache->path) + 8;
+    char path_tmp[size];
+    snprintf(path_tmp, size, "%s.XXXXXX", cache->path);
+    int fd = mkstemp(path_tmp);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "w");
+    if(out == NULL){
+        perror(path_tmp);
+        if(fd != -1){
+            close(fd);
+            unlink(path_tmp);
+        }
+        free(slots);
+        return -1;
+    }
+    // The entries are written in the order their offsets were given.
+    cache_header header = { .slot_count = slot_count };
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(slots, sizeof(cache_slot), slot_count, out);
+    for(i=0; i<cache->slot_count; i++){
+        if(slot_kept(cache, &cache->slots[i]))
+            fwrite(cache->map + cache->slots[i].offset, 1, cache->slots[i].size, out);
+    }
+    for(i=0; i<cache->table_size; i++){
+        if(cache->table[i])
+            fwrite(cache->table[i]->data, 1, cache->table[i]->size, out);
+    }
+    free(slots);
+    int rc = fchmod(fd, 0644) == -1 || ferror(out) ? -1 : 0;
+    if(fclose(out) == EOF || rc == -1 || rename(path_tmp, cache->path) == -1){
+        perror(cache->path);
+        unlink(path_tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void free_cache(opustags_cache *cache){
+    while(cache->items){
+        cache_item *next = cache->items->next;
+        free(cache->items);
+        cache->items = next;
+    }
+    free(cache->table);
+    if(cache->map)
+        munmap(cache->map, cache->map_size);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+typedef struct {
+    opustags_edits edits;
+    int set_all;
+    const char *path_out;
+    const char *inplace;
+    int overwrite;
+    int batch;
+    int keep_cache;
+    int format;
+    // Where the tags are listed and the errors reported: stdout and stderr,
+    // or the reply to a --serve client.
+    FILE *output;
+    FILE *errors;
+    opustags_cache *cache;
+    // Files kept open or read at the same time by each job with io_uring.
+    int ring_depth;
+    int durability;
+    // With --export-picture, where the picture goes instead of the listing.
+    FILE *picture;
+    int stats;
+} opustags_options;
+
+void file_error(const opustags_options *opts, const char *path, const char *format, ...){
+    va_list ap;
+    flockfile(opts->errors);
+    if(opts->batch)
+        fprintf(opts->errors, "%s: ", path);
+    va_start(ap, format);
+    vfprintf(opts->errors, format, ap);
+    va_end(ap);
+    fputc('\n', opts->errors);
+    funlockfile(opts->errors);
+}
+
+char *read_comments(FILE *stream, size_t limit, const char ***comment, uint32_t *count){
+    // Note: the returned buffer holds the comments and must be freed, as well as *comment.
+    size_t raw_size = 16384, raw_len = 0, n;
+    char *raw_tags = malloc(raw_size);
+    if(raw_tags == NULL){
+        fputs("malloc: not enough memory for buffering stdin\n", stderr);
+        return NULL;
+    }
+    while((n = fread(raw_tags + raw_len, 1, raw_size - raw_len - 1, stream)) != 0){
+        raw_len += n;
+        if(raw_len > limit){
+            fprintf(stderr, "error: the comments read from stdin exceed %zu bytes (see --set-all-max)\n", limit);
+            free(raw_tags);
+            return NULL;
+        }
+        if(raw_len < raw_size - 1)
+            continue;
+        char *grown = realloc(raw_tags, raw_size * 2);
+        if(grown == NULL){
+            fputs("malloc: not enough memory for buffering stdin\n", stderr);
+            free(raw_tags);
+            return NULL;
+        }
+        raw_tags = grown;
+        raw_size *= 2;
+    }
+    if(ferror(stream)){
+        perror("fread");
+        free(raw_tags);
+        return NULL;
+    }
+    raw_tags[raw_len] = '\0';
+    const char **raw_comment = NULL;
+    uint32_t raw_count = 0, raw_max = 0;
+    size_t field_len = 0;
+    int caught_eq = 0;
+    size_t i = 0;
+    char *cursor = raw_tags;
+    for(i=0; i <= raw_len; i++){
+        if(raw_tags[i] == '\n' || raw_tags[i] == '\0'){
+            if(field_len == 0)
+                continue;
+            if(caught_eq){
+                if(raw_count == raw_max){
+                    raw_max = raw_max ? raw_max * 2 : 64;
+                    const char **grown = realloc(raw_comment, raw_max * sizeof(char*));
+                    if(grown == NULL){
+                        fputs("malloc: not enough memory for the comments\n", stderr);
+                        free(raw_comment);
+                        free(raw_tags);
+                        return NULL;
+                    }
+                    raw_comment = grown;
+                }
+                raw_comment[raw_count++] = cursor;
+            }
+            else
+                fputs("warning: skipping malformed tag\n", stderr);
+            cursor = raw_tags + i + 1;
+            field_len = 0;
+            caught_eq = 0;
+            raw_tags[i] = '\0';
+            continue;
+        }
+        if(raw_tags[i] == '=')
+            caught_eq = 1;
+        field_len++;
+    }
+    *comment = raw_comment;
+    *count = raw_count;
+    return raw_tags;
+}
+
+// Ways of handling a file reported by --stats beside those of the library.
+#define STATS_PATH_CACHED 64
+#define STATS_PATH_HTTP 128
+#define STATS_PATH_RING 256
+#define STATS_PATHS 9
+
+const char *path_names[STATS_PATHS] = {
+    "mapped", "direct", "in_place", "clone", "kernel_copy", "renumber", "cached", "http", "io_uring",
+};
+
+const char *phase_names[OPUSTAGS_PHASES] = {
+    "read", "pageout", "parse", "edit", "render", "write", "tail",
+};
+
+uint64_t clock_ns(clockid_t clock){
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Input files shared by the workers of a batch.
+typedef struct {
+    pthread_mutex_t lock;
+    char **paths;
+    int count;
+    FILE *files0;
+    const char *files0_from;
+    const opustags_options *opts;
+    int status;
+    // Listening socket of --serve, or -1, and the maximum size of its requests.
+    int server;
+    size_t request_max;
+    // Requests read from --manifest, numbered so that their replies are written
+    // in the same order.
+    FILE *manifest;
+    const char *manifest_from;
+    unsigned long records, replies;
+    pthread_cond_t turn;
+    // With --recursive, the directories left to walk and the files found in
+    // them, along with the number of directories being read.
+    int recursive;
+    char **dirs, **found;
+    size_t dir_count, dir_size, found_count, found_size;
+    int walking;
+    pthread_cond_t walked;
+    // Files edited in place with --durability=batch, synced and renamed once
+    // they're all written.
+    struct opustags_rename *renames;
+    size_t rename_count, rename_size;
+} opustags_batch;
+
+typedef struct opustags_rename {
+    // The temporary file replacing path, or NULL if path was rewritten in place.
+    char *path_tmp, *path;
+    cache_item *item;
+} opustags_rename;
+
+typedef struct {
+    opustags_batch *batch;
+    pthread_t thread;
+    int status;
+    // State kept from one file to the next.
+    opustags_context ctx;
+    char *path_tmp;
+    size_t path_tmp_size;
+    // Buffer of the output files.
+    char *out_buf;
+    // Connection kept open to the server of the last remote file, and the
+    // bytes received past the last response header.
+    int http_fd;
+    char http_origin[280];
+    char *http_buf;
+    size_t http_start, http_left;
+    // With --stats, the work done on the current file, and on all of them.
+    opustags_stats stats, total;
+    unsigned long files, failed, path_files[STATS_PATHS];
+} opustags_worker;
+
+// File the tags passed to inspect_tags come from.
+typedef struct {
+    const opustags_options *opts;
+    const char *path;
+    // With --cache, the tags to store for the file, and when listing, the edits
+    // left to apply to them.
+    cache_item *item;
+    const opustags_edits *edits;
+    int rc;
+    // With --link all, the number of links listed so far.
+    int link;
+} opustags_listing;
+
+// Forget the counts of an attempt at reading a file, but not its times.
+void reset_counts(opustags_stats *stats){
+    stats->bytes_read = stats->bytes_written = 0;
+    stats->header_pages = stats->tail_pages = 0;
+    stats->comments = stats->header_size = 0;
+}
+
+// Write the fields of a --stats record that are common to the files and the totals.
+void print_stats(const opustags_stats *stats, uint64_t wall_ns, uint64_t cpu_ns, FILE *out){
+    int i;
+    fprintf(out, "\"wall_ns\":%" PRIu64 ",\"cpu_ns\":%" PRIu64 ",\"bytes_read\":%" PRIu64 ",\"bytes_written\":%" PRIu64
+            ",\"header_pages\":%" PRIu64 ",\"tail_pages\":%" PRIu64 ",\"comments\":%" PRIu64 ",\"header_size\":%" PRIu64,
+            wall_ns, cpu_ns, stats->bytes_read, stats->bytes_written, stats->header_pages, stats->tail_pages,
+            stats->comments, stats->header_size);
+    fputs(",\"phases\":{", out);
+    for(i=0; i<OPUSTAGS_PHASES; i++)
+        fprintf(out, "%s\"%s\":{\"wall_ns\":%" PRIu64 ",\"cpu_ns\":%" PRIu64 "}", i ? "," : "", phase_names[i],
+                stats->wall_ns[i], stats->cpu_ns[i]);
+    fputc('}', out);
+}
+
+// Report the stats of the file just handled as a JSON line on stderr, and add
+// them to the totals of the worker.
+void report_stats(opustags_worker *worker, const char *path, int ok, uint64_t wall_ns, uint64_t cpu_ns){
+    opustags_stats *stats = &worker->stats, *total = &worker->total;
+    json_escaper e = { 0 };
+    int i, sep = 0;
+    flockfile(stderr);
+    fputs("{\"file\":\"", stderr);
+    json_write(&e, (const unsigned char*) path, strlen(path), stderr);
+    json_end(&e, stderr);
+    fprintf(stderr, "\",\"ok\":%s,", ok ? "true" : "false");
+    print_stats(stats, wall_ns, cpu_ns, stderr);
+    fputs(",\"paths\":[", stderr);
+    for(i=0; i<STATS_PATHS; i++){
+        if(stats->paths & 1 << i){
+            fprintf(stderr, "%s\"%s\"", sep ? "," : "", path_names[i]);
+            sep = 1;
+            worker->path_files[i]++;
+        }
+    }
+    fputs("]}\n", stderr);
+    funlockfile(stderr);
+    total->bytes_read += stats->bytes_read;
+    total->bytes_written += stats->bytes_written;
+    total->header_pages += stats->header_pages;
+    total->tail_pages += stats->tail_pages;
+    total->comments += stats->comments;
+    total->header_size += stats->header_size;
+    for(i=0; i<OPUSTAGS_PHASES; i++){
+        total->wall_ns[i] += stats->wall_ns[i];
+        total->cpu_ns[i] += stats->cpu_ns[i];
+    }
+    worker->files++;
+    worker->failed += !ok;
+    memset(stats, 0, sizeof(*stats));
+}
+
+void list_tags(const opus_tags *tags, const opustags_listing *listing){
+    // Keep the listings of concurrent workers apart.
+    FILE *out = listing->opts->output;
+    flockfile(out);
+    int link = listing->opts->edits.link == OPUSTAGS_ALL_LINKS ? listing->link : 0;
+    if(listing->opts->format == FORMAT_JSON)
+        print_tags_json(tags, listing->path, link, out);
+    else if(listing->opts->format == FORMAT_NUL)
+        print_tags_nul(tags, listing->path, out);
+    else{
+        if(link > 0)
+            fprintf(out, "==> %s (link %d) <==\n", listing->path, link);
+        else if(listing->opts->batch)
+            fprintf(out, "==> %s <==\n", listing->path);
+        print_tags(tags, out);
+    }
+    funlockfile(out);
+}
+
+// Warn about the data following the comments, and print the tags in read-only mode.
+void inspect_tags(opus_tags *tags, void *arg){
+    opustags_listing *listing = arg;
+    if(tags->trailing_data > 0)
+        fprintf(stderr, "warning: keeping %ld unknown bytes at the end of the OpusTags packet\n", tags->trailing_data);
+    if(listing->opts->cache){
+        // A file that isn't cached is read again next time.
+        free(listing->item);
+        listing->item = make_item(tags);
+    }
+    if(listing->edits){
+        listing->rc = edit_tags(tags, listing->edits);
+        if(listing->rc == OPUSTAGS_OK)
+            listing->rc = keep_tags(tags, listing->edits->to_get, listing->edits->count_get);
+        if(listing->rc != OPUSTAGS_OK)
+            return;
+    }
+    if(listing->opts->path_out != NULL || listing->opts->inplace != NULL)
+        return;
+    if(listing->opts->picture){
+        listing->rc = export_picture(tags, listing->opts->picture);
+        return;
+    }
+    listing->link++;
+    list_tags(tags, listing);
+}
+
+// List the tags of the file identified by key from the cache, unless they aren't
+// there or some of the comments to list were left out. Return 1 if they were listed.
+int list_cached(const opustags_listing *listing, const cache_key *key){
+    const opustags_options *opts = listing->opts;
+    const unsigned char *data;
+    size_t size = find_cached(opts->cache, key, &data);
+    if(size < 4)
+        return 0;
+    uint32_t n = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+    opus_tags tags, omitted;
+    if(n > size - 4 || parse_tags((char*) data + 4, n, &tags) != OPUSTAGS_OK)
+        return 0;
+    if(parse_tags((char*) data + 4 + n, size - 4 - n, &omitted) != OPUSTAGS_OK){
+        free_tags(&tags);
+        return 0;
+    }
+    int listed = 1, j;
+    uint32_t i;
+    for(i=0; i<omitted.count && listed; i++){
+        listed = opts->edits.count_get > 0;
+        for(j=0; j<opts->edits.count_get && listed; j++)
+            listed = !match_field(omitted.comment[i], omitted.lengths[i], opts->edits.to_get[j]);
+    }
+    if(listed && edit_tags(&tags, &opts->edits) == OPUSTAGS_OK &&
+       keep_tags(&tags, opts->edits.to_get, opts->edits.count_get) == OPUSTAGS_OK)
+        list_tags(&tags, listing);
+    else
+        listed = 0;
+    free_tags(&omitted);
+    free_tags(&tags);
+    return listed;
+}
+
+// Store the tags inspected last as those of the file at path, once written.
+void cache_written(opustags_listing *listing, const char *path){
+    struct stat st;
+    cache_key key;
+    if(listing->item && stat(path, &st) == 0 && S_ISREG(st.st_mode)){
+        make_key(&st, &key);
+        store_cached(listing->opts->cache, &key, listing->item);
+        listing->item = NULL;
+    }
+}
+
+void close_input(int fd){
+    if(fd != STDIN_FILENO)
+        close(fd);
+}
+
+// Remote files are read over HTTP with range requests, starting with the first
+// HTTP_READ bytes, and then twice as many at a time while the comment header
+// goes on, up to HTTP_READ_MAX.
+#define HTTP_READ (64 << 10)
+#define HTTP_READ_MAX (64 << 20)
+#define HTTP_HEADER_MAX (16 << 10)
+
+int is_url(const char *path){
+    return strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0;
+}
+
+// Split an http:// URL into the host, the port and the request target.
+int parse_url(const char *url, char *host, size_t host_size, char *port, size_t port_size, const char **target){
+    const char *authority = url + 7, *end = authority + strcspn(authority, "/?#"), *colon = NULL, *p;
+    const char *host_end = end;
+    if(*authority == '['){
+        // An IPv6 address.
+        const char *bracket = memchr(authority, ']', end - authority);
+        if(bracket == NULL)
+            return -1;
+        authority++;
+        host_end = bracket;
+        if(bracket + 1 < end && bracket[1] == ':')
+            colon = bracket + 1;
+    }
+    else if((p = memchr(authority, ':', end - authority)) != NULL){
+        colon = p;
+        host_end = p;
+    }
+    if(host_end == authority || host_end - authority >= host_size || strncmp(url, "http://", 7) != 0)
+        return -1;
+    memcpy(host, authority, host_end - authority);
+    host[host_end - authority] = '\0';
+    if(colon && colon + 1 < end){
+        if(end - colon - 1 >= port_size)
+            return -1;
+        memcpy(port, colon + 1, end - colon - 1);
+        port[end - colon - 1] = '\0';
+    }
+    else
+        snprintf(port, port_size, "80");
+    *target = *end == '/' ? end : "/";
+    return 0;
+}
+
+int http_connect(const char *host, const char *port, char *error, size_t error_size){
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *ai;
+    int rc = getaddrinfo(host, port, &hints, &res), fd = -1;
+    if(rc != 0){
+        snprintf(error, error_size, "%s: %s", host, gai_strerror(rc));
+        return -1;
+    }
+    for(ai = res; ai != NULL && fd == -1; ai = ai->ai_next){
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if(fd == -1)
+            continue;
+        // A stalled server fails the file instead of the whole run.
+        struct timeval timeout = { .tv_sec = 30 };
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == -1){
+            snprintf(error, error_size, "connect: %s", strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Read from the connection of the worker into dst, using the bytes already
+// received first.
+ssize_t http_read(opustags_worker *worker, void *dst, size_t len){
+    if(worker->http_left > 0){
+        size_t n = worker->http_left < len ? worker->http_left : len;
+        memcpy(dst, worker->http_buf + worker->http_start, n);
+        worker->http_start += n;
+        worker->http_left -= n;
+        return n;
+    }
+    ssize_t n;
+    while((n = recv(worker->http_fd, dst, len, 0)) == -1 && errno == EINTR);
+    return n;
+}
+
+void http_close(opustags_worker *worker){
+    if(worker->http_fd != -1)
+        close(worker->http_fd);
+    worker->http_fd = -1;
+    worker->http_left = 0;
+}
+
+// Fetch up to len bytes of url from offset into dst, over the connection kept
+// by the worker when it's to the same server. Set *complete if the file ends
+// there. Return the number of bytes fetched, or -1 with the cause in error.
+ssize_t http_range(opustags_worker *worker, const char *url, off_t offset, size_t len, unsigned char *dst,
+                   int *complete, char *error, size_t error_size){
+    char host[256], port[16], origin[sizeof(host) + sizeof(port) + 3];
+    const char *target;
+    if(parse_url(url, host, sizeof(host), port, sizeof(port), &target) == -1){
+        snprintf(error, error_size, strncmp(url, "https://", 8) == 0 ? "only http:// URLs are supported" : "invalid URL");
+        return -1;
+    }
+    snprintf(origin, sizeof(origin), strchr(host, ':') ? "[%s]:%s" : "%s:%s", host, port);
+    if(worker->http_fd != -1 && strcmp(worker->http_origin, origin) != 0)
+        http_close(worker);
+    if(worker->http_buf == NULL && (worker->http_buf = malloc(HTTP_HEADER_MAX)) == NULL){
+        snprintf(error, error_size, "failure to allocate memory");
+        return -1;
+    }
+    int attempt;
+    for(attempt = 0; attempt < 2; attempt++){
+        // A reused connection may have been closed by the server meanwhile.
+        int reused = worker->http_fd != -1;
+        if(!reused){
+            if((worker->http_fd = http_connect(host, port, error, error_size)) == -1)
+                return -1;
+            snprintf(worker->http_origin, sizeof(worker->http_origin), "%s", origin);
+        }
+        char request[8192];
+        int n = snprintf(request, sizeof(request),
+                         "GET %s HTTP/1.1\r\nHost: %s%s%s%s%s\r\nRange: bytes=%jd-%jd\r\nUser-Agent: opustags\r\n\r\n",
+                         target, strchr(host, ':') ? "[" : "", host, strchr(host, ':') ? "]" : "",
+                         strcmp(port, "80") ? ":" : "", strcmp(port, "80") ? port : "",
+                         (intmax_t) offset, (intmax_t) (offset + len - 1));
+        if(n >= sizeof(request)){
+            snprintf(error, error_size, "URL too long");
+            return -1;
+        }
+        if(send(worker->http_fd, request, n, MSG_NOSIGNAL) != n){
+            snprintf(error, error_size, "send: %s", strerror(errno));
+            http_close(worker);
+            if(reused)
+                continue;
+            return -1;
+        }
+        // Read the status line and the header fields.
+        size_t got = 0;
+        char *end = NULL;
+        ssize_t r = 0;
+        worker->http_left = 0;
+        while(end == NULL && got < HTTP_HEADER_MAX - 1 &&
+              (r = http_read(worker, worker->http_buf + got, HTTP_HEADER_MAX - 1 - got)) > 0){
+            got += r;
+            worker->http_buf[got] = '\0';
+            end = strstr(worker->http_buf, "\r\n\r\n");
+        }
+        if(end == NULL){
+            if(got == 0 && reused){
+                http_close(worker);
+                continue;
+            }
+            snprintf(error, error_size, got == 0 ? "the server closed the connection" : "invalid HTTP response");
+            http_close(worker);
+            return -1;
+        }
+        *end = '\0';
+        worker->http_start = end + 4 - worker->http_buf;
+        worker->http_left = got - worker->http_start;
+        int status = 0;
+        if(sscanf(worker->http_buf, "HTTP/1.%*d %d", &status) != 1){
+            snprintf(error, error_size, "invalid HTTP response");
+            http_close(worker);
+            return -1;
+        }
+        // The fields that matter, whatever their case.
+        intmax_t length = -1, first = 0, last = -1, total = -1;
+        int keep = 1;
+        char *line, *next;
+        for(line = strstr(worker->http_buf, "\r\n"); line != NULL; line = next){
+            line += 2;
+            if((next = strstr(line, "\r\n")) != NULL)
+                *next = '\0';
+            if(strncasecmp(line, "Content-Length:", 15) == 0)
+                length = strtoimax(line + 15, NULL, 10);
+            else if(strncasecmp(line, "Content-Range:", 14) == 0)
+                sscanf(line + 14, " bytes %jd-%jd/%jd", &first, &last, &total);
+            else if(strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line + 11, "close"))
+                keep = 0;
+            else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+                length = -2;
+        }
+        if(status == 416){
+            // Past the end of the file.
+            *complete = 1;
+            http_close(worker);
+            return 0;
+        }
+        if(status != 200 && status != 206){
+            snprintf(error, error_size, "HTTP status %d", status);
+            http_close(worker);
+            return -1;
+        }
+        if(length == -2){
+            snprintf(error, error_size, "chunked HTTP responses aren't supported");
+            http_close(worker);
+            return -1;
+        }
+        // A server ignoring the range sends the whole file, which is then cut.
+        off_t skip = status == 200 ? offset : 0;
+        size_t want = len, done = 0;
+        if(status == 206){
+            if(first != offset || last < first){
+                snprintf(error, error_size, "invalid Content-Range");
+                http_close(worker);
+                return -1;
+            }
+            if(last - first + 1 < want)
+                want = last - first + 1;
+            *complete = total != -1 && last + 1 >= total;
+        }
+        else
+            *complete = length != -1 && length <= offset + len;
+        if(length != -1 && length - skip < (intmax_t) want)
+            want = length > skip ? length - skip : 0;
+        while(skip > 0 && (r = http_read(worker, dst, skip < len ? skip : len)) > 0)
+            skip -= r;
+        while(skip == 0 && done < want && (r = http_read(worker, dst + done, want - done)) > 0)
+            done += r;
+        if(done < want && status == 200 && length == -1 && r == 0)
+            *complete = 1;
+        else if(done < want){
+            snprintf(error, error_size, "the server closed the connection");
+            http_close(worker);
+            return -1;
+        }
+        // Reuse the connection only if the response was read to its end.
+        if(!keep || status == 200 || length == -1 || length != (intmax_t) want || worker->http_left > 0)
+            http_close(worker);
+        return done;
+    }
+    return -1;
+}
+
+// List the tags of the file at url, fetching no more of it than its headers.
+int list_url(opustags_worker *worker, opustags_listing *listing, const char *url){
+    const opustags_options *opts = listing->opts;
+    unsigned char *data = NULL;
+    size_t size = 0, len = 0;
+    char error[512];
+    int complete = 0, rc;
+    for(;;){
+        size_t grown_size = size ? 2 * size : HTTP_READ;
+        unsigned char *grown = realloc(data, grown_size);
+        if(grown == NULL){
+            file_error(opts, url, "failure to allocate memory");
+            free(data);
+            return -1;
+        }
+        data = grown;
+        size = grown_size;
+        ssize_t n = http_range(worker, url, len, size - len, data + len, &complete, error, sizeof(error));
+        if(n == -1){
+            file_error(opts, url, "%s", error);
+            free(data);
+            return -1;
+        }
+        len += n;
+        // Later links can be anywhere, so the whole file is needed.
+        if(opts->edits.link != 0 && !complete && n > 0){
+            if(size < HTTP_READ_MAX)
+                continue;
+            file_error(opts, url, "error: the file is too large to look for its links");
+            free(data);
+            return -1;
+        }
+        reset_counts(&worker->stats);
+        rc = len == 0 ? OPUSTAGS_INVALID_FILE : edit_buffer(&worker->ctx, &opts->edits, data, len, NULL, inspect_tags, listing);
+        if(rc == OPUSTAGS_OK)
+            rc = listing->rc;
+        if(rc != OPUSTAGS_INVALID_FILE || complete || n == 0 || size >= HTTP_READ_MAX)
+            break;
+    }
+    free(data);
+    worker->stats.paths |= STATS_PATH_HTTP;
+    worker->stats.bytes_read = len;
+    if(rc != OPUSTAGS_OK){
+        file_error(opts, url, "%s", opustags_strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+#define OUT_BUFFER_SIZE (1 << 20)
+
+// Size of a file of size bytes once edited, assuming no comment is deleted.
+// The page headers of the comments that grow the header are not counted.
+off_t estimate_size(off_t size, const opustags_edits *edits){
+    int i;
+    uint32_t j;
+    for(i=0; i<edits->count_add; i++)
+        size += 4 + strlen(edits->to_add[i]);
+    for(j=0; j<edits->count_set; j++)
+        size += 4 + strlen(edits->to_set[j]);
+    return edits->pad > 0 ? size + edits->pad : size;
+}
+
+// Sync the directory holding path, so that a new entry in it is durable.
+int sync_parent(const char *path){
+    const char *slash = strrchr(path, '/');
+    size_t len = slash == NULL ? 1 : slash == path ? 1 : slash - path;
+    char dir[len + 1];
+    if(slash == NULL)
+        strcpy(dir, ".");
+    else{
+        memcpy(dir, path, len);
+        dir[len] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1)
+        return -1;
+    int rc = fsync(fd);
+    int error = errno;
+    close(fd);
+    errno = error;
+    return rc;
+}
+
+// Leave path_tmp to replace path at the end of the batch, with the tags to cache then.
+int defer_rename(opustags_batch *batch, opustags_listing *listing, const char *path_tmp, const char *path){
+    opustags_rename r = { .path = strdup(path), .path_tmp = path_tmp ? strdup(path_tmp) : NULL };
+    int rc = -1;
+    pthread_mutex_lock(&batch->lock);
+    if(r.path && (r.path_tmp || !path_tmp)){
+        if(batch->rename_count == batch->rename_size){
+            size_t size = batch->rename_size ? 2 * batch->rename_size : 256;
+            opustags_rename *grown = realloc(batch->renames, size * sizeof(opustags_rename));
+            if(grown){
+                batch->renames = grown;
+                batch->rename_size = size;
+            }
+        }
+        if(batch->rename_count < batch->rename_size){
+            r.item = listing->item;
+            listing->item = NULL;
+            batch->renames[batch->rename_count++] = r;
+            rc = 0;
+        }
+    }
+    pthread_mutex_unlock(&batch->lock);
+    if(rc == -1){
+        free(r.path);
+        free(r.path_tmp);
+        file_error(listing->opts, path, "failure to allocate memory");
+        if(path_tmp)
+            remove(path_tmp);
+    }
+    return rc;
+}
+
+int compare_strings(const void *a, const void *b){
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Sync the files written by the batch, then rename them over the original files
+// and sync their directories, once each. Nothing is renamed if the sync fails,
+// and a failed rename leaves the other files to be renamed.
+int finish_renames(opustags_batch *batch){
+    size_t i, j, dev_count = 0, dir_count = 0;
+    int status = 0, synced;
+    if(batch->rename_count == 0)
+        return 0;
+    // At most one file system per file; without the list, every file is synced.
+    dev_t *devs = calloc(batch->rename_count, sizeof(dev_t));
+    char **dirs = calloc(batch->rename_count, sizeof(char*));
+    for(i=0; i<batch->rename_count && status == 0; i++){
+        opustags_rename *r = &batch->renames[i];
+        const char *path = r->path_tmp ? r->path_tmp : r->path;
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd == -1 || fstat(fd, &st) == -1){
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            status = -1;
+        }
+        else{
+#ifdef __linux__
+            // One syncfs per file system.
+            for(j=0; j<dev_count && devs[j] != st.st_dev; j++);
+            if(j == dev_count){
+                if(devs)
+                    devs[dev_count++] = st.st_dev;
+                if(syncfs(fd) == -1){
+                    fprintf(stderr, "%s: syncfs: %s\n", path, strerror(errno));
+                    status = -1;
+                }
+            }
+#else
+            if(fsync(fd) == -1){
+                fprintf(stderr, "%s: fsync: %s\n", path, strerror(errno));
+                status = -1;
+            }
+#endif
+        }
+        if(fd != -1)
+            close(fd);
+    }
+    synced = status == 0;
+    for(i=0; i<batch->rename_count; i++){
+        opustags_rename *r = &batch->renames[i];
+        // A file edited in place is already changed, but maybe not durably, so
+        // it isn't cached. The others are left as they were.
+        if(!synced && r->path_tmp == NULL)
+            fprintf(stderr, "%s: edited in place, but the edit may not be durable\n", r->path);
+        else if(!synced){
+            fprintf(stderr, "%s: left unchanged, as its edit could not be synced\n", r->path);
+            remove(r->path_tmp);
+        }
+        else if(r->path_tmp && rename(r->path_tmp, r->path) == -1){
+            fprintf(stderr, "%s: rename: %s\n", r->path, strerror(errno));
+            status = -1;
+        }
+        else{
+            opustags_listing listing = { .opts = batch->opts, .item = r->item };
+            if(r->item)
+                cache_written(&listing, r->path);
+            r->item = listing.item;
+            if(r->path_tmp && dirs){
+                // The directory is kept as the path up to its last slash.
+                char *slash = strrchr(r->path, '/');
+                dirs[dir_count++] = r->path;
+                if(slash)
+                    slash[1] = '\0';
+                else
+                    r->path[0] = '\0';
+            }
+        }
+    }
+    // The paths now name their directories.
+    if(dirs)
+        qsort(dirs, dir_count, sizeof(char*), compare_strings);
+    for(i=0; i<dir_count; i++){
+        if(i > 0 && strcmp(dirs[i], dirs[i-1]) == 0)
+            continue;
+        const char *dir = dirs[i][0] ? dirs[i] : ".";
+        int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(fd == -1 || fsync(fd) == -1){
+            fprintf(stderr, "%s: fsync: %s\n", dir, strerror(errno));
+            status = -1;
+        }
+        if(fd != -1)
+            close(fd);
+    }
+    if(dirs == NULL && status == 0){
+        fputs("failure to allocate memory to sync the directories\n", stderr);
+        status = -1;
+    }
+    for(i=0; i<batch->rename_count; i++){
+        free(batch->renames[i].path);
+        free(batch->renames[i].path_tmp);
+        free(batch->renames[i].item);
+    }
+    free(devs);
+    free(dirs);
+    return status;
+}
+
+int edit_path(opustags_worker *worker, opustags_listing *listing, const char *path_in){
+    const opustags_options *opts = listing->opts;
+    const opustags_edits *edits = &opts->edits;
+    opustags_edits none = { .pad = -1 };
+    struct stat st;
+    cache_key key;
+    int cached = 0;
+    if(is_url(path_in)){
+        if(opts->path_out || opts->inplace){
+            file_error(opts, path_in, "error: remote files can only be listed");
+            return -1;
+        }
+        return list_url(worker, listing, path_in);
+    }
+    if(opts->cache && !opts->path_out && !opts->inplace && strcmp(path_in, "-") != 0){
+        if(stat(path_in, &st) == 0 && S_ISREG(st.st_mode)){
+            make_key(&st, &key);
+            if(list_cached(listing, &key)){
+                worker->stats.paths |= STATS_PATH_CACHED;
+                return 0;
+            }
+        }
+        // The tags are cached as they are in the file, and only edited for the listing.
+        listing->edits = edits;
+        edits = &none;
+        cached = 1;
+    }
+    const char *path_out = opts->path_out;
+    if(path_out != NULL && strcmp(path_in, "-") != 0){
+        char canon_in[PATH_MAX+1], canon_out[PATH_MAX+1];
+        if(realpath(path_in, canon_in) && realpath(path_out, canon_out)){
+            if(strcmp(canon_in, canon_out) == 0){
+                file_error(opts, path_in, "error: the input and output files are the same");
+                return -1;
+            }
+        }
+    }
+    int in;
+    if(strcmp(path_in, "-") == 0){
+        if(opts->set_all){
+            file_error(opts, path_in, "can't open stdin for input when -S is specified");
+            return -1;
+        }
+        if(opts->inplace){
+            file_error(opts, path_in, "cannot modify stdin 'in-place'");
+            return -1;
+        }
+        in = STDIN_FILENO;
+    }
+    else{
+        if(opts->inplace && (in = open(path_in, O_RDWR)) != -1){
+            // Try to overwrite the comment header inside the file first.
+            int rewritten;
+            int rc = rewrite_in_place(&worker->ctx, edits, in, inspect_tags, listing, &rewritten);
+            int error = errno;
+            if(rc == OPUSTAGS_OK && rewritten && opts->durability == DURABILITY_FILE && fdatasync(in) == -1)
+                rc = OPUSTAGS_ERRNO;
+            if(close(in) == -1 && rc == OPUSTAGS_OK)
+                rc = OPUSTAGS_ERRNO;
+            if(rc == OPUSTAGS_PARTIAL_WRITE){
+                file_error(opts, path_in, "%s (pwrite: %s)", opustags_strerror(rc), strerror(error));
+                return -1;
+            }
+            if(rc != OPUSTAGS_OK){
+                file_error(opts, path_in, "%s", opustags_strerror(rc));
+                return -1;
+            }
+            if(rewritten && opts->durability == DURABILITY_BATCH)
+                return defer_rename(worker->batch, listing, NULL, path_in);
+            if(rewritten){
+                cache_written(listing, path_in);
+                return 0;
+            }
+        }
+        in = open(path_in, O_RDONLY);
+    }
+    if(in == -1){
+        file_error(opts, path_in, "open: %s", strerror(errno));
+        return -1;
+    }
+    // The identity of the file is taken before reading it, so that the tags
+    // aren't cached if it's modified meanwhile.
+    if(cached){
+        if(fstat(in, &st) == 0 && S_ISREG(st.st_mode))
+            make_key(&st, &key);
+        else
+            cached = 0;
+    }
+    FILE *out = NULL;
+    off_t preallocated = 0;
+    if(opts->inplace != NULL){
+        size_t size = strlen(path_in) + strlen(opts->inplace) + 1;
+        if(size > worker->path_tmp_size){
+            char *path_tmp = realloc(worker->path_tmp, size);
+            if(path_tmp == NULL){
+                file_error(opts, path_in, "failure to allocate memory");
+                close_input(in);
+                return -1;
+            }
+            worker->path_tmp = path_tmp;
+            worker->path_tmp_size = size;
+        }
+        strcpy(worker->path_tmp, path_in);
+        strcat(worker->path_tmp, opts->inplace);
+        path_out = worker->path_tmp;
+    }
+    if(path_out != NULL){
+        if(strcmp(path_out, "-") == 0)
+            out = stdout;
+        else{
+            if(!opts->overwrite && !opts->inplace){
+                if(access(path_out, F_OK) == 0){
+                    file_error(opts, path_in, "'%s' already exists (use -y to overwrite)", path_out);
+                    close_input(in);
+                    return -1;
+                }
+            }
+            out = fopen(path_out, "w");
+            if(!out){
+                file_error(opts, path_in, "fopen: %s", strerror(errno));
+                close_input(in);
+                return -1;
+            }
+            // The pages are written in large chunks, to a file allocated at
+            // once, so that it's hardly fragmented. The audio of --in-place
+            // is cloned where the file system allows it, which doesn't need
+            // any space.
+            if(worker->out_buf || (worker->out_buf = malloc(OUT_BUFFER_SIZE)))
+                setvbuf(out, worker->out_buf, _IOFBF, OUT_BUFFER_SIZE);
+#ifdef FALLOC_FL_KEEP_SIZE
+            struct stat st_in;
+            if(!opts->inplace && fstat(in, &st_in) == 0 && S_ISREG(st_in.st_mode) && st_in.st_size > 0){
+                off_t size = estimate_size(st_in.st_size, edits);
+                if(fallocate(fileno(out), FALLOC_FL_KEEP_SIZE, 0, size) == 0)
+                    preallocated = size;
+            }
+#endif
+        }
+    }
+    int flags = (opts->inplace ? OPUSTAGS_CLONE : 0) | (opts->keep_cache ? OPUSTAGS_KEEP_CACHE : 0) |
+                (opts->edits.count_get || opts->picture ? OPUSTAGS_LAZY : 0);
+    int rc = edit_file(&worker->ctx, edits, in, out, flags, inspect_tags, listing);
+    if(rc == OPUSTAGS_OK)
+        rc = listing->rc;
+    // Closing the files may change errno.
+    const char *error = rc != OPUSTAGS_OK ? opustags_strerror(rc) : NULL;
+    // Release the space allocated past the end of the file. Truncating a file
+    // to its own size may keep the blocks, so it's first extended over them.
+    struct stat st_out;
+    if(rc == OPUSTAGS_OK && preallocated &&
+       (fflush(out) == EOF || fstat(fileno(out), &st_out) == -1 ||
+        (st_out.st_size < preallocated &&
+         (ftruncate(fileno(out), preallocated) == -1 || ftruncate(fileno(out), st_out.st_size) == -1)))){
+        file_error(opts, path_in, "ftruncate: %s", strerror(errno));
+        rc = OPUSTAGS_ERRNO;
+    }
+    // A file written with -o is synced on its own, even for a batch.
+    int durable = opts->durability == DURABILITY_FILE || (opts->durability == DURABILITY_BATCH && !opts->inplace);
+    if(rc == OPUSTAGS_OK && out && out != stdout && durable && (fflush(out) == EOF || fsync(fileno(out)) == -1)){
+        file_error(opts, path_in, "fsync: %s", strerror(errno));
+        rc = OPUSTAGS_ERRNO;
+    }
+    close_input(in);
+    if(out && out != stdout){
+        if(fclose(out) == EOF && rc == OPUSTAGS_OK){
+            file_error(opts, path_in, "fclose: %s", strerror(errno));
+            rc = OPUSTAGS_ERRNO;
+        }
+    }
+    else if(out)
+        fflush(out);
+    if(rc != OPUSTAGS_OK){
+        if(error)
+            file_error(opts, path_in, "%s", error);
+        if(path_out != NULL && out != stdout)
+            remove(path_out);
+        return -1;
+    }
+    else if(opts->inplace && opts->durability == DURABILITY_BATCH)
+        return defer_rename(worker->batch, listing, path_out, path_in);
+    else if(opts->inplace){
+        if(rename(path_out, path_in) == -1){
+            file_error(opts, path_in, "rename: %s", strerror(errno));
+            return -1;
+        }
+        if(durable && sync_parent(path_in) == -1){
+            file_error(opts, path_in, "fsync: %s", strerror(errno));
+            return -1;
+        }
+        cache_written(listing, path_in);
+    }
+    else if(cached && listing->item){
+        store_cached(opts->cache, &key, listing->item);
+        listing->item = NULL;
+    }
+    else if(path_out != NULL && out != stdout){
+        if(durable && sync_parent(path_out) == -1){
+            file_error(opts, path_in, "fsync: %s", strerror(errno));
+            return -1;
+        }
+        cache_written(listing, path_out);
+    }
+    return 0;
+}
+
+int process_file(opustags_worker *worker, const opustags_options *opts, const char *path_in){
+    opustags_listing listing = { .opts = opts, .path = path_in };
+    uint64_t wall = 0, cpu = 0;
+    if(opts->stats){
+        wall = clock_ns(CLOCK_MONOTONIC);
+        cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    }
+    int rc = edit_path(worker, &listing, path_in);
+    free(listing.item);
+    if(opts->stats)
+        report_stats(worker, path_in, rc != -1, clock_ns(CLOCK_MONOTONIC) - wall, clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu);
+    return rc;
+}
+
+// Take the next operand, with the lock held.
+const char *next_operand(opustags_batch *batch, char **buf, size_t *size){
+    const char *path = NULL;
+    if(batch->files0){
+        ssize_t n;
+        while(path == NULL && (n = getdelim(buf, size, '\0', batch->files0)) != -1){
+            if(n > 0 && (*buf)[n-1] == '\0')
+                n--;
+            if(n > 0)
+                path = *buf;
+        }
+        if(path == NULL){
+            if(ferror(batch->files0)){
+                perror(batch->files0_from);
+                batch->status = EXIT_FAILURE;
+            }
+            batch->files0 = NULL;
+        }
+    }
+    else if(batch->count > 0){
+        path = *batch->paths++;
+        batch->count--;
+    }
+    return path;
+}
+
+// Append the string s to the list, with the lock held. The list owns it then.
+int push_path(char ***list, size_t *count, size_t *size, char *s){
+    if(*count == *size){
+        size_t grown_size = *size ? 2 * *size : 256;
+        char **grown = realloc(*list, grown_size * sizeof(char*));
+        if(grown == NULL){
+            free(s);
+            return -1;
+        }
+        *list = grown;
+        *size = grown_size;
+    }
+    (*list)[(*count)++] = s;
+    return 0;
+}
+
+// Keep the Ogg files found by the walk.
+int is_ogg_name(const char *name){
+    size_t len = strlen(name);
+    return (len > 5 && strcasecmp(name + len - 5, ".opus") == 0) ||
+           (len > 4 && strcasecmp(name + len - 4, ".ogg") == 0);
+}
+
+// Read the directory at path, and queue its subdirectories and Ogg files. Symbolic
+// links to directories aren't followed, so the walk never loops.
+void walk_dir(opustags_batch *batch, const char *path){
+    char **dirs = NULL, **found = NULL;
+    size_t dir_count = 0, dir_size = 0, found_count = 0, found_size = 0, i;
+    int failed = 0;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+    if(dir == NULL){
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        if(fd != -1)
+            close(fd);
+        pthread_mutex_lock(&batch->lock);
+        batch->status = EXIT_FAILURE;
+        pthread_mutex_unlock(&batch->lock);
+        return;
+    }
+    size_t path_len = strlen(path);
+    // No double slash after a directory given as "dir/".
+    int slash = path_len > 0 && path[path_len - 1] != '/';
+    struct dirent *entry;
+    for(errno = 0; (entry = readdir(dir)) != NULL; errno = 0){
+        const char *name = entry->d_name;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        int is_dir = entry->d_type == DT_DIR, is_file = entry->d_type == DT_REG;
+        if(entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN){
+            struct stat st;
+            if(fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0){
+                if(S_ISLNK(st.st_mode))
+                    is_file = fstatat(fd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+                else{
+                    is_dir = S_ISDIR(st.st_mode);
+                    is_file = S_ISREG(st.st_mode);
+                }
+            }
+        }
+        if(!is_dir && !(is_file && is_ogg_name(name)))
+            continue;
+        size_t len = path_len + slash + strlen(name) + 1;
+        char *child = malloc(len);
+        if(child == NULL){
+            failed = 1;
+            break;
+        }
+        snprintf(child, len, "%s%s%s", path, slash ? "/" : "", name);
+        if(is_dir ? push_path(&dirs, &dir_count, &dir_size, child) : push_path(&found, &found_count, &found_size, child)){
+            failed = 1;
+            break;
+        }
+    }
+    int error = errno;
+    if(failed || error != 0){
+        fprintf(stderr, "%s: %s\n", path, failed ? "failure to allocate memory" : strerror(error));
+        failed = 1;
+    }
+    closedir(dir);
+    // Queue the entries all at once, so that the workers seldom wait for the lock.
+    // They're taken from the end, so they're queued backwards to keep their order.
+    pthread_mutex_lock(&batch->lock);
+    for(i=dir_count; i>0; i--)
+        failed |= push_path(&batch->dirs, &batch->dir_count, &batch->dir_size, dirs[i-1]) == -1;
+    for(i=found_count; i>0; i--)
+        failed |= push_path(&batch->found, &batch->found_count, &batch->found_size, found[i-1]) == -1;
+    if(failed)
+        batch->status = EXIT_FAILURE;
+    pthread_cond_broadcast(&batch->walked);
+    pthread_mutex_unlock(&batch->lock);
+    free(dirs);
+    free(found);
+}
+
+const char *next_file(opustags_batch *batch, char **buf, size_t *size){
+    // Note: *buf is the caller's own buffer, as the file list may be read concurrently.
+    const char *path = NULL;
+    pthread_mutex_lock(&batch->lock);
+    while(batch->recursive){
+        // The files found first, then the directories, then more operands.
+        if(batch->found_count > 0){
+            char *found = batch->found[--batch->found_count];
+            size_t len = strlen(found) + 1;
+            if(len > *size){
+                char *grown = realloc(*buf, len);
+                if(grown == NULL){
+                    fprintf(stderr, "%s: failure to allocate memory\n", found);
+                    batch->status = EXIT_FAILURE;
+                    free(found);
+                    continue;
+                }
+                *buf = grown;
+                *size = len;
+            }
+            memcpy(*buf, found, len);
+            free(found);
+            path = *buf;
+            break;
+        }
+        char *dir = batch->dir_count > 0 ? batch->dirs[--batch->dir_count] : NULL;
+        const char *operand = dir ? NULL : next_operand(batch, buf, size);
+        if(dir || operand){
+            // Read the directory while the other workers go on.
+            struct stat st;
+            batch->walking++;
+            pthread_mutex_unlock(&batch->lock);
+            int is_dir = dir || (stat(operand, &st) == 0 && S_ISDIR(st.st_mode));
+            if(is_dir)
+                walk_dir(batch, dir ? dir : operand);
+            free(dir);
+            pthread_mutex_lock(&batch->lock);
+            if(--batch->walking == 0)
+                pthread_cond_broadcast(&batch->walked);
+            if(!is_dir){
+                path = operand;
+                break;
+            }
+            continue;
+        }
+        if(batch->walking == 0)
+            break;
+        pthread_cond_wait(&batch->walked, &batch->lock);
+    }
+    if(!batch->recursive)
+        path = next_operand(batch, buf, size);
+    pthread_mutex_unlock(&batch->lock);
+    return path;
+}
+
+// Read the next request of a --serve client or a --manifest, made of NUL-terminated
+// fields up to an empty one, and store the fields one after the other in *buf, *len
+// bytes in all.
+// Return 1 if a request was read, 0 when the client is done, -1 on error.
+int read_request(FILE *in, size_t max, char **buf, size_t *size, size_t *len, char **field, size_t *field_size){
+    ssize_t n;
+    *len = 0;
+    while((n = getdelim(field, field_size, '\0', in)) != -1){
+        // A request cut by the end of the connection is dropped.
+        if((*field)[n-1] != '\0')
+            return -1;
+        if(n == 1)
+            return 1;
+        if(*len + n > max)
+            return -1;
+        if(*len + n > *size){
+            size_t grown_size = *size ? *size : 4096;
+            while(grown_size < *len + n)
+                grown_size *= 2;
+            char *grown = realloc(*buf, grown_size);
+            if(grown == NULL)
+                return -1;
+            *buf = grown;
+            *size = grown_size;
+        }
+        memcpy(*buf + *len, *field, n);
+        *len += n;
+    }
+    return *len == 0 && !ferror(in) ? 0 : -1;
+}
+
+// Apply the edits of a request to its file, the first field, then reply with the
+// listing of the tags, or the errors.
+// Return 1 if the request failed, 0 if it succeeded, -1 if the reply couldn't be written.
+int serve_request(opustags_worker *worker, char *fields, size_t len, FILE *out){
+    const opustags_options *base = worker->batch->opts;
+    opustags_options opts = {
+        .edits = { .pad = base->edits.pad, .no_verify_tail = base->edits.no_verify_tail, .link = base->edits.link },
+        // Unlike a manifest, a server reads the same files again and again.
+        .keep_cache = worker->batch->server != -1,
+        .format = base->format,
+        .cache = base->cache,
+        // Each reply tells whether its edit was made, so it can't wait for the others.
+        .durability = base->durability == DURABILITY_BATCH ? DURABILITY_FILE : base->durability,
+    };
+    char *body = NULL, *msg = NULL, *end = fields + len, *arg;
+    size_t body_len = 0, msg_len = 0, count = 0;
+    int rc = -1;
+    for(arg = fields; arg < end; arg += strlen(arg) + 1)
+        count++;
+    const char **to_add = malloc(count * sizeof(char*) + 1);
+    const char **to_delete = malloc(count * sizeof(char*) + 1);
+    const char **to_get = malloc(count * sizeof(char*) + 1);
+    opts.edits.to_add = to_add;
+    opts.edits.to_delete = to_delete;
+    opts.edits.to_get = to_get;
+    opts.output = open_memstream(&body, &body_len);
+    opts.errors = open_memstream(&msg, &msg_len);
+    if(to_add == NULL || to_delete == NULL || to_get == NULL || opts.output == NULL || opts.errors == NULL){
+        if(opts.output)
+            fclose(opts.output);
+        if(opts.errors)
+            fclose(opts.errors);
+        free(body);
+        free(msg);
+        free(to_add);
+        free(to_delete);
+        free(to_get);
+        fputs("ERROR 14\nout of memory\n", out);
+        return fflush(out) == EOF ? -1 : 1;
+    }
+    const char *path = count > 0 ? fields : "";
+    if(count == 0)
+        fputs("missing file name\n", opts.errors);
+    else if(strcmp(path, "-") == 0)
+        file_error(&opts, path, "can't read stdin from a request");
+    else{
+        rc = 0;
+        for(arg = fields + strlen(fields) + 1; arg < end && rc == 0; arg += strlen(arg) + 1){
+            char *value = arg + strlen(arg) + 1;
+            if(strcmp(arg, "-D") == 0)
+                opts.edits.delete_all = 1;
+            else if(strcmp(arg, "-i") == 0)
+                opts.inplace = ".otmp";
+            else if(strcmp(arg, "-a") != 0 && strcmp(arg, "-s") != 0 && strcmp(arg, "-d") != 0 &&
+                    strcmp(arg, "--get") != 0){
+                file_error(&opts, path, "invalid request field: '%s'", arg);
+                rc = -1;
+            }
+            else if(value >= end){
+                file_error(&opts, path, "missing value after '%s'", arg);
+                rc = -1;
+            }
+            else if((arg[1] == 'd' || arg[1] == '-') && strchr(value, '=') != NULL){
+                file_error(&opts, path, "invalid field: '%s'", value);
+                rc = -1;
+            }
+            else if((arg[1] == 'a' || arg[1] == 's') && strchr(value, '=') == NULL){
+                file_error(&opts, path, "invalid comment: '%s'", value);
+                rc = -1;
+            }
+            else{
+                if(arg[1] == '-')
+                    to_get[opts.edits.count_get++] = value;
+                if(arg[1] == 'd' || arg[1] == 's')
+                    to_delete[opts.edits.count_delete++] = value;
+                if(arg[1] == 'a' || arg[1] == 's')
+                    to_add[opts.edits.count_add++] = value;
+                arg = value;
+            }
+        }
+        if(rc == 0 && opts.inplace && opts.edits.count_get){
+            file_error(&opts, path, "--get only applies to listings");
+            rc = -1;
+        }
+        if(rc == 0)
+            rc = process_file(worker, &opts, path);
+    }
+    fclose(opts.output);
+    fclose(opts.errors);
+    if(rc == 0){
+        fprintf(out, "OK %zu\n", body_len);
+        fwrite(body, 1, body_len, out);
+    }
+    else{
+        fprintf(out, "ERROR %zu\n", msg_len);
+        fwrite(msg, 1, msg_len, out);
+    }
+    free(body);
+    free(msg);
+    free(to_add);
+    free(to_delete);
+    free(to_get);
+    if(fflush(out) == EOF)
+        return -1;
+    return rc == 0 ? 0 : 1;
+}
 
-#ifdef __APPLE__
-#include <libkern/OSByteOrder.h>
-#define htole32(x) OSSwapHostToLittleInt32(x)
-#define le32toh(x) OSSwapLittleToHostInt32(x)
-#endif
+// Serve the clients of the --serve socket, one connection at a time, answering
+// their requests in order.
+void serve_clients(opustags_worker *worker){
+    char *buf = NULL, *field = NULL;
+    size_t size = 0, field_size = 0, len;
+    for(;;){
+        int fd = accept(worker->batch->server, NULL, NULL);
+        if(fd == -1){
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                // Wait for other connections to close.
+                struct timespec pause = { .tv_nsec = 10000000 };
+                nanosleep(&pause, NULL);
+                continue;
+            }
+            perror("accept");
+            worker->status = EXIT_FAILURE;
+            break;
+        }
+        int out_fd = dup(fd);
+        FILE *in = fdopen(fd, "r"), *out = out_fd == -1 ? NULL : fdopen(out_fd, "w");
+        if(in && out){
+            while(read_request(in, worker->batch->request_max, &buf, &size, &len, &field, &field_size) == 1){
+                if(serve_request(worker, buf, len, out) == -1)
+                    break;
+            }
+        }
+        if(in)
+            fclose(in);
+        else
+            close(fd);
+        if(out)
+            fclose(out);
+        else if(out_fd != -1)
+            close(out_fd);
+    }
+    free(buf);
+    free(field);
+}
 
-typedef struct {
-    uint32_t vendor_length;
-    const char *vendor_string;
-    uint32_t count;
-    uint32_t *lengths;
-    const char **comment;
-} opus_tags;
-
-int parse_tags(char *data, long len, opus_tags *tags){
-    long pos;
-    if(len < 8+4+4)
-        return -1;
-    if(strncmp(data, "OpusTags", 8) != 0)
-        return -1;
-    // Vendor
-    pos = 8;
-    tags->vendor_length = le32toh(*((uint32_t*) (data + pos)));
-    tags->vendor_string = data + pos + 4;
-    pos += 4 + tags->vendor_length;
-    if(pos + 4 > len)
-        return -1;
-    // Count
-    tags->count = le32toh(*((uint32_t*) (data + pos)));
-    if(tags->count == 0)
-        return 0;
-    tags->lengths = calloc(tags->count, sizeof(uint32_t));
-    if(tags->lengths == NULL)
+// Read the next request of the manifest, and number it. Return as read_request.
+int next_record(opustags_batch *batch, unsigned long *number, char **buf, size_t *size, size_t *len,
+                char **field, size_t *field_size){
+    int rc = 0;
+    pthread_mutex_lock(&batch->lock);
+    if(batch->manifest){
+        rc = read_request(batch->manifest, batch->request_max, buf, size, len, field, field_size);
+        if(rc == -1){
+            if(ferror(batch->manifest))
+                perror(batch->manifest_from);
+            else
+                fprintf(stderr, "%s: truncated or oversized record\n", batch->manifest_from);
+            batch->status = EXIT_FAILURE;
+        }
+        if(rc != 1)
+            batch->manifest = NULL;
+        *number = batch->records++;
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return rc;
+}
+
+// Apply the requests of the manifest, writing their replies to stdout in order.
+void run_manifest(opustags_worker *worker){
+    opustags_batch *batch = worker->batch;
+    char *buf = NULL, *field = NULL, *reply = NULL;
+    size_t size = 0, field_size = 0, len, reply_len;
+    unsigned long number;
+    while(next_record(batch, &number, &buf, &size, &len, &field, &field_size) == 1){
+        FILE *out = open_memstream(&reply, &reply_len);
+        int rc = out ? serve_request(worker, buf, len, out) : -1;
+        if(out)
+            fclose(out);
+        if(rc != 0)
+            worker->status = EXIT_FAILURE;
+        // Wait for the replies of the records read before.
+        pthread_mutex_lock(&batch->lock);
+        while(batch->replies != number)
+            pthread_cond_wait(&batch->turn, &batch->lock);
+        if(rc == -1)
+            fputs("ERROR 14\nout of memory\n", stdout);
+        else
+            fwrite(reply, 1, reply_len, stdout);
+        batch->replies++;
+        pthread_cond_broadcast(&batch->turn);
+        pthread_mutex_unlock(&batch->lock);
+        free(reply);
+        reply = NULL;
+    }
+    free(buf);
+    free(field);
+}
+
+// Listen on the Unix socket at path, replacing the socket of a server that's gone.
+int open_server(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "socket path too long: '%s'\n", path);
         return -1;
-    tags->comment = calloc(tags->count, sizeof(char*));
-    if(tags->comment == NULL){
-        free(tags->lengths);
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1){
+        perror("socket");
         return -1;
     }
-    pos += 4;
-    // Comment
-    uint32_t i;
-    for(i=0; i<tags->count; i++){
-        tags->lengths[i] = le32toh(*((uint32_t*) (data + pos)));
-        tags->comment[i] = data + pos + 4;
-        pos += 4 + tags->lengths[i];
-        if(pos > len)
-            return -1;
+    struct stat st;
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)){
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(probe != -1 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) == -1 && errno == ECONNREFUSED)
+            unlink(path);
+        if(probe != -1)
+            close(probe);
     }
-
-    if(pos < len)
-        fprintf(stderr, "warning: %ld unused bytes at the end of the OpusTags packet\n", len - pos);
-
-    return 0;
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1){
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-int render_tags(opus_tags *tags, ogg_packet *op){
-    // Note: op->packet must be manually freed.
-    op->b_o_s = 0;
-    op->e_o_s = 0;
-    op->granulepos = 0;
-    op->packetno = 1;
-    long len = 8 + 4 + tags->vendor_length + 4;
-    uint32_t i;
-    for(i=0; i<tags->count; i++)
-        len += 4 + tags->lengths[i];
-    op->bytes = len;
-    char *data = malloc(len);
-    if(!data)
+#ifdef OPUSTAGS_URING
+// Submission and completion queues of an io_uring, set up with the raw system
+// calls so as not to depend on liburing.
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    unsigned queued;
+} opustags_ring;
+
+int setup_ring(opustags_ring *ring, unsigned entries){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(ring->fd == -1)
+        return -1;
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // Both rings may share a single mapping.
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single && ring->cq_map_size > ring->sq_map_size)
+        ring->sq_map_size = ring->cq_map_size;
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED){
+        int error = errno;
+        if(ring->sq_map != MAP_FAILED)
+            munmap(ring->sq_map, ring->sq_map_size);
+        if(!single && ring->cq_map != MAP_FAILED)
+            munmap(ring->cq_map, ring->cq_map_size);
+        if(ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        errno = error;
         return -1;
-    op->packet = (unsigned char*) data;
-    uint32_t n;
-    memcpy(data, "OpusTags", 8);
-    n = htole32(tags->vendor_length);
-    memcpy(data+8, &n, 4);
-    memcpy(data+12, tags->vendor_string, tags->vendor_length);
-    data += 12 + tags->vendor_length;
-    n = htole32(tags->count);
-    memcpy(data, &n, 4);
-    data += 4;
-    for(i=0; i<tags->count; i++){
-        n = htole32(tags->lengths[i]);
-        memcpy(data, &n, 4);
-        memcpy(data+4, tags->comment[i], tags->lengths[i]);
-        data += 4 + tags->lengths[i];
     }
+    unsigned char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
     return 0;
 }
 
-int match_field(const char *comment, uint32_t len, const char *field){
-    size_t field_len;
-    for(field_len = 0; field[field_len] != '\0' && field[field_len] != '='; field_len++);
-    if(len <= field_len)
-        return 0;
-    if(comment[field_len] != '=')
-        return 0;
-    if(strncmp(comment, field, field_len) != 0)
-        return 0;
-    return 1;
+void free_ring(opustags_ring *ring){
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
 
+// Queue a request, submitted along with the others by wait_ring.
+// The ring never holds more requests than it has entries.
+struct io_uring_sqe *queue_request(opustags_ring *ring, int opcode, uint64_t user_data){
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
 }
 
-void delete_tags(opus_tags *tags, const char *field){
-    uint32_t i;
-    for(i=0; i<tags->count; i++){
-        if(match_field(tags->comment[i], tags->lengths[i], field)){
-            tags->count--;
-            tags->lengths[i] = tags->lengths[tags->count];
-            tags->comment[i] = tags->comment[tags->count];
-            // No need to resize the arrays.
+// Submit the queued requests and wait for a completion.
+int wait_ring(opustags_ring *ring){
+    for(;;){
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(n >= 0){
+            ring->queued -= n;
+            return 0;
         }
+        if(errno != EINTR)
+            return -1;
     }
 }
 
-int add_tags(opus_tags *tags, const char **tags_to_add, uint32_t count){
-    if(count == 0)
-        return 0;
-    uint32_t *lengths = realloc(tags->lengths, (tags->count + count) * sizeof(uint32_t));
-    const char **comment = realloc(tags->comment, (tags->count + count) * sizeof(char*));
-    if(lengths == NULL || comment == NULL)
-        return -1;
-    tags->lengths = lengths;
-    tags->comment = comment;
-    uint32_t i;
-    for(i=0; i<count; i++){
-        tags->lengths[tags->count + i] = strlen(tags_to_add[i]);
-        tags->comment[tags->count + i] = tags_to_add[i];
+// Files listed by list_with_ring: first opened, then read from the start.
+typedef struct {
+    char *name;
+    size_t name_size;
+    const char *path;
+    int fd;
+    unsigned char *data;
+    size_t size, len;
+    // With --stats, when the file was opened, and the CPU time spent listing it.
+    uint64_t opened, cpu_ns;
+} ring_file;
+
+// Initial size of the reads, enough for the comment headers without pictures,
+// and largest one, past which the file is left to process_file.
+#define RING_READ (64 << 10)
+#define RING_READ_MAX (4 << 20)
+
+// List the tags of the file read into f->data, which holds all of it if complete.
+// Return 1 if its comment header goes further than what was read.
+int list_read(opustags_worker *worker, const opustags_options *opts, ring_file *f, int complete){
+    opustags_listing listing = { .opts = opts, .path = f->path };
+    const opustags_edits *edits = &opts->edits;
+    opustags_edits none = { .pad = -1 };
+    struct stat st;
+    cache_key key;
+    int cached = 0;
+    if(opts->cache && fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode)){
+        make_key(&st, &key);
+        listing.edits = edits;
+        edits = &none;
+        cached = 1;
+    }
+    uint64_t cpu = opts->stats ? clock_ns(CLOCK_THREAD_CPUTIME_ID) : 0;
+    reset_counts(&worker->stats);
+    int rc = edit_buffer(&worker->ctx, edits, f->data, f->len, NULL, inspect_tags, &listing);
+    if(rc == OPUSTAGS_OK)
+        rc = listing.rc;
+    if(opts->stats)
+        f->cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    if(rc == OPUSTAGS_INVALID_FILE && !complete){
+        free(listing.item);
+        return 1;
+    }
+    if(!opts->keep_cache)
+        posix_fadvise(f->fd, 0, f->len, POSIX_FADV_DONTNEED);
+    if(rc != OPUSTAGS_OK){
+        file_error(opts, f->path, "%s", opustags_strerror(rc));
+        worker->status = EXIT_FAILURE;
+    }
+    else if(cached && listing.item){
+        store_cached(opts->cache, &key, listing.item);
+        listing.item = NULL;
+    }
+    free(listing.item);
+    if(opts->stats){
+        worker->stats.paths |= STATS_PATH_RING;
+        worker->stats.bytes_read = f->len;
+        report_stats(worker, f->path, rc == OPUSTAGS_OK, clock_ns(CLOCK_MONOTONIC) - f->opened, f->cpu_ns);
     }
-    tags->count += count;
     return 0;
 }
 
-void print_tags(opus_tags *tags){
-    if(tags->count == 0)
-        puts("no tags");
-    int i;
-    for(i=0; i<tags->count; i++){
-        fwrite(tags->comment[i], 1, tags->lengths[i], stdout);
-        puts("");
+// Open the next file of the batch that isn't listed from the cache, as file i.
+// Return 0 when there are none left.
+int open_next(opustags_worker *worker, opustags_ring *ring, ring_file *files, int i){
+    const opustags_options *opts = worker->batch->opts;
+    ring_file *f = &files[i];
+    while((f->path = next_file(worker->batch, &f->name, &f->name_size)) != NULL){
+        struct stat st;
+        cache_key key;
+        opustags_listing listing = { .opts = opts, .path = f->path };
+        if(strcmp(f->path, "-") == 0 || is_url(f->path)){
+            if(process_file(worker, opts, f->path) == -1)
+                worker->status = EXIT_FAILURE;
+            continue;
+        }
+        uint64_t opened = opts->stats ? clock_ns(CLOCK_MONOTONIC) : 0;
+        if(opts->cache && stat(f->path, &st) == 0 && S_ISREG(st.st_mode)){
+            make_key(&st, &key);
+            if(list_cached(&listing, &key)){
+                if(opts->stats){
+                    worker->stats.paths |= STATS_PATH_CACHED;
+                    report_stats(worker, f->path, 1, clock_ns(CLOCK_MONOTONIC) - opened, 0);
+                }
+                continue;
+            }
+        }
+        f->opened = opened;
+        f->cpu_ns = 0;
+        struct io_uring_sqe *sqe = queue_request(ring, IORING_OP_OPENAT, i);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) f->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        f->fd = -1;
+        f->len = 0;
+        return 1;
     }
+    return 0;
 }
 
-void free_tags(opus_tags *tags){
-    if(tags->count > 0){
-        free(tags->lengths);
-        free(tags->comment);
-    }
+void read_more(opustags_ring *ring, ring_file *f, int i){
+    struct io_uring_sqe *sqe = queue_request(ring, IORING_OP_READ, i);
+    sqe->fd = f->fd;
+    sqe->addr = (uintptr_t) (f->data + f->len);
+    sqe->len = f->size - f->len;
+    sqe->off = f->len;
 }
 
-int write_page(ogg_page *og, FILE *stream){
-    if(fwrite(og->header, 1, og->header_len, stream) < og->header_len)
+// List the tags of the files of the batch, keeping up to depth of them opened or
+// read at the same time. Return -1 if io_uring is not available.
+int list_with_ring(opustags_worker *worker, int depth){
+    const opustags_options *opts = worker->batch->opts;
+    opustags_ring ring;
+    if(setup_ring(&ring, depth) == -1)
         return -1;
-    if(fwrite(og->body, 1, og->body_len, stream) < og->body_len)
+    ring_file *files = calloc(depth, sizeof(ring_file));
+    if(files == NULL){
+        free_ring(&ring);
         return -1;
+    }
+    int i, pending = 0;
+    for(i=0; i<depth && open_next(worker, &ring, files, i); i++)
+        pending++;
+    while(pending > 0){
+        if(wait_ring(&ring) == -1){
+            perror("io_uring_enter");
+            worker->status = EXIT_FAILURE;
+            break;
+        }
+        unsigned head = *ring.cq_head;
+        while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            int res = cqe->res;
+            i = cqe->user_data;
+            ring_file *f = &files[i];
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+            pending--;
+            if(f->fd == -1){
+                // Opened: read the start of the file, in a buffer that may have
+                // grown for the previous one.
+                if(res >= 0){
+                    f->fd = res;
+                    unsigned char *data = realloc(f->data, RING_READ);
+                    if(data != NULL){
+                        f->data = data;
+                        f->size = RING_READ;
+                        read_more(&ring, f, i);
+                        pending++;
+                        continue;
+                    }
+                }
+            }
+            else if(res >= 0){
+                f->len += res;
+                if(!list_read(worker, opts, f, res == 0)){
+                    close(f->fd);
+                    if(open_next(worker, &ring, files, i))
+                        pending++;
+                    continue;
+                }
+                // A listing of a few fields skips the large comments that don't fit.
+                unsigned char *grown = NULL;
+                if(f->len == f->size && f->size < RING_READ_MAX && opts->edits.count_get == 0 &&
+                   (grown = realloc(f->data, 2 * f->size))){
+                    f->data = grown;
+                    f->size *= 2;
+                }
+                if(f->len < f->size){
+                    read_more(&ring, f, i);
+                    pending++;
+                    continue;
+                }
+            }
+            // Let process_file read the file, or report why it can't.
+            if(f->fd != -1)
+                close(f->fd);
+            if(process_file(worker, opts, f->path) == -1)
+                worker->status = EXIT_FAILURE;
+            if(open_next(worker, &ring, files, i))
+                pending++;
+        }
+    }
+    for(i=0; i<depth; i++){
+        free(files[i].name);
+        free(files[i].data);
+    }
+    free(files);
+    free_ring(&ring);
     return 0;
 }
+#endif
 
-const char *version = "opustags version 1.1\n";
-
-const char *usage =
-    "Usage: opustags --help\n"
-    "       opustags [OPTIONS] FILE\n"
-    "       opustags OPTIONS FILE -o FILE\n";
-
-const char *help =
-    "Options:\n"
-    "  -h, --help              print this help\n"
-    "  -o, --output            write the modified tags to a file\n"
-    "  -i, --in-place [SUFFIX] use a temporary file then replace the original file\n"
-    "  -y, --overwrite         overwrite the output file if it already exists\n"
-    "  -d, --delete FIELD      delete all the fields of a specified type\n"
-    "  -a, --add FIELD=VALUE   add a field\n"
-    "  -s, --set FIELD=VALUE   delete then add a field\n"
-    "  -D, --delete-all        delete all the fields!\n"
-    "  -S, --set-all           read the fields from stdin\n";
+// Report the totals of the workers as the last JSON line of --stats.
+void report_totals(const opustags_worker *workers, long count, uint64_t wall_ns){
+    opustags_stats total = { 0 };
+    unsigned long files = 0, failed = 0, path_files[STATS_PATHS] = { 0 };
+    long w;
+    int i;
+    for(w=0; w<count; w++){
+        const opustags_stats *s = &workers[w].total;
+        total.bytes_read += s->bytes_read;
+        total.bytes_written += s->bytes_written;
+        total.header_pages += s->header_pages;
+        total.tail_pages += s->tail_pages;
+        total.comments += s->comments;
+        total.header_size += s->header_size;
+        for(i=0; i<OPUSTAGS_PHASES; i++){
+            total.wall_ns[i] += s->wall_ns[i];
+            total.cpu_ns[i] += s->cpu_ns[i];
+        }
+        files += workers[w].files;
+        failed += workers[w].failed;
+        for(i=0; i<STATS_PATHS; i++)
+            path_files[i] += workers[w].path_files[i];
+    }
+    flockfile(stderr);
+    fprintf(stderr, "{\"files\":%lu,\"failed\":%lu,", files, failed);
+    print_stats(&total, wall_ns, clock_ns(CLOCK_PROCESS_CPUTIME_ID), stderr);
+    fputs(",\"paths\":{", stderr);
+    for(i=0; i<STATS_PATHS; i++)
+        fprintf(stderr, "%s\"%s\":%lu", i ? "," : "", path_names[i], path_files[i]);
+    fputs("}}\n", stderr);
+    funlockfile(stderr);
+}
 
-struct option options[] = {
-    {"help", no_argument, 0, 'h'},
-    {"output", required_argument, 0, 'o'},
-    {"in-place", optional_argument, 0, 'i'},
-    {"overwrite", no_argument, 0, 'y'},
-    {"delete", required_argument, 0, 'd'},
-    {"add", required_argument, 0, 'a'},
-    {"set", required_argument, 0, 's'},
-    {"delete-all", no_argument, 0, 'D'},
-    {"set-all", no_argument, 0, 'S'},
-    {NULL, 0, 0, 0}
-};
+void *run_worker(void *arg){
+    opustags_worker *worker = arg;
+    const char *path;
+    char *buf = NULL;
+    size_t size = 0;
+    worker->status = EXIT_SUCCESS;
+    worker->path_tmp = NULL;
+    worker->path_tmp_size = 0;
+    worker->out_buf = NULL;
+    worker->http_fd = -1;
+    worker->http_buf = NULL;
+    worker->http_left = 0;
+    memset(&worker->stats, 0, sizeof(worker->stats));
+    memset(&worker->total, 0, sizeof(worker->total));
+    worker->files = worker->failed = 0;
+    memset(worker->path_files, 0, sizeof(worker->path_files));
+    if(init_context(&worker->ctx) != OPUSTAGS_OK){
+        fputs("ogg_stream_init: couldn't create the streams\n", stderr);
+        worker->status = EXIT_FAILURE;
+        return NULL;
+    }
+    if(worker->batch->opts->stats)
+        worker->ctx.stats = &worker->stats;
+    if(worker->batch->server != -1)
+        serve_clients(worker);
+    if(worker->batch->manifest)
+        run_manifest(worker);
+#ifdef OPUSTAGS_URING
+    const opustags_options *opts = worker->batch->opts;
+    if(opts->ring_depth > 0 && !opts->path_out && !opts->inplace && opts->edits.link == 0)
+        list_with_ring(worker, opts->ring_depth);
+#endif
+    while((path = next_file(worker->batch, &buf, &size)) != NULL){
+        if(process_file(worker, worker->batch->opts, path) == -1)
+            worker->status = EXIT_FAILURE;
+    }
+    free_context(&worker->ctx);
+    free(worker->path_tmp);
+    free(worker->out_buf);
+    http_close(worker);
+    free(worker->http_buf);
+    free(buf);
+    return NULL;
+}
 
 int main(int argc, char **argv){
     if(argc == 1){
@@ -202,35 +2467,51 @@ int main(int argc, char **argv){
         fputs(usage, stdout);
         return EXIT_SUCCESS;
     }
-    char *path_in, *path_out = NULL, *inplace = NULL;
     const char* to_add[argc];
     const char* to_delete[argc];
-    int count_add = 0, count_delete = 0;
-    int delete_all = 0;
-    int set_all = 0;
-    int overwrite = 0;
+    const char* to_get[argc];
+    opustags_options opts = {
+        .edits = {
+            .to_add = to_add,
+            .to_delete = to_delete,
+            .to_get = to_get,
+            .pad = -1,
+        },
+        .output = stdout,
+        .errors = stderr,
+    };
+    // Up to 64 MiB of comments are read from stdin by default.
+    unsigned long long set_all_max = 64 << 20;
+    const char *files0_from = NULL;
+    const char *serve = NULL;
+    const char *manifest_from = NULL;
+    const char *cache_path = NULL;
+    const char *export_picture_to = NULL, *import_picture_from = NULL;
+    long jobs = 0;
+    char *end;
     int print_help = 0;
+    int recursive = 0;
     int c;
-    while((c = getopt_long(argc, argv, "ho:i::yd:a:s:DS", options, NULL)) != -1){
+    while((c = getopt_long(argc, argv, "ho:i::yd:a:s:DSj:r", options, NULL)) != -1){
         switch(c){
             case 'h':
                 print_help = 1;
                 break;
             case 'o':
-                path_out = optarg;
+                opts.path_out = optarg;
                 break;
             case 'i':
-                inplace = optarg == NULL ? ".otmp" : optarg;
+                opts.inplace = optarg == NULL ? ".otmp" : optarg;
                 break;
             case 'y':
-                overwrite = 1;
+                opts.overwrite = 1;
                 break;
             case 'd':
                 if(strchr(optarg, '=') != NULL){
                     fprintf(stderr, "invalid field: '%s'\n", optarg);
                     return EXIT_FAILURE;
                 }
-                to_delete[count_delete++] = optarg;
+                to_delete[opts.edits.count_delete++] = optarg;
                 break;
             case 'a':
             case 's':
@@ -238,14 +2519,112 @@ int main(int argc, char **argv){
                     fprintf(stderr, "invalid comment: '%s'\n", optarg);
                     return EXIT_FAILURE;
                 }
-                to_add[count_add++] = optarg;
+                to_add[opts.edits.count_add++] = optarg;
                 if(c == 's')
-                    to_delete[count_delete++] = optarg;
+                    to_delete[opts.edits.count_delete++] = optarg;
                 break;
             case 'S':
-                set_all = 1;
+                opts.set_all = 1;
             case 'D':
-                delete_all = 1;
+                opts.edits.delete_all = 1;
+                break;
+            case OPT_FILES0_FROM:
+                files0_from = optarg;
+                break;
+            case OPT_PAD:
+                opts.edits.pad = strtol(optarg, &end, 10);
+                if(*optarg == '\0' || *end != '\0' || opts.edits.pad < 0 || opts.edits.pad > INT_MAX){
+                    fprintf(stderr, "invalid padding: '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_SET_ALL_MAX:
+                set_all_max = strtoull(optarg, &end, 10);
+                if(*optarg == '\0' || *optarg == '-' || *end != '\0' || set_all_max >= SIZE_MAX){
+                    fprintf(stderr, "invalid limit: '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_NO_VERIFY_TAIL:
+                opts.edits.no_verify_tail = 1;
+                break;
+            case OPT_SERVE:
+                serve = optarg;
+                break;
+            case OPT_MANIFEST:
+                manifest_from = optarg;
+                break;
+            case OPT_CACHE:
+                cache_path = optarg;
+                break;
+            case OPT_EXPORT_PICTURE:
+                export_picture_to = optarg;
+                break;
+            case OPT_IMPORT_PICTURE:
+                import_picture_from = optarg;
+                break;
+            case OPT_STATS:
+                opts.stats = 1;
+                break;
+            case OPT_IO_URING:
+                opts.ring_depth = strtol(optarg, &end, 10);
+                if(*optarg == '\0' || *end != '\0' || opts.ring_depth < 1 || opts.ring_depth > 4096){
+                    fprintf(stderr, "invalid queue depth: '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_GET:
+                if(strchr(optarg, '=') != NULL){
+                    fprintf(stderr, "invalid field: '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                to_get[opts.edits.count_get++] = optarg;
+                break;
+            case OPT_DURABILITY:
+                if(strcmp(optarg, "none") == 0)
+                    opts.durability = DURABILITY_NONE;
+                else if(strcmp(optarg, "file") == 0)
+                    opts.durability = DURABILITY_FILE;
+                else if(strcmp(optarg, "batch") == 0)
+                    opts.durability = DURABILITY_BATCH;
+                else{
+                    fprintf(stderr, "invalid durability: '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_LINK:
+                if(strcmp(optarg, "all") == 0)
+                    opts.edits.link = OPUSTAGS_ALL_LINKS;
+                else{
+                    long link = strtol(optarg, &end, 10);
+                    if(*optarg == '\0' || *end != '\0' || link < 1 || link > INT_MAX){
+                        fprintf(stderr, "invalid link: '%s'\n", optarg);
+                        return EXIT_FAILURE;
+                    }
+                    opts.edits.link = link - 1;
+                }
+                break;
+            case OPT_FORMAT:
+                if(strcmp(optarg, "text") == 0)
+                    opts.format = FORMAT_TEXT;
+                else if(strcmp(optarg, "json") == 0)
+                    opts.format = FORMAT_JSON;
+                else if(strcmp(optarg, "nul") == 0)
+                    opts.format = FORMAT_NUL;
+                else{
+                    fprintf(stderr, "invalid format: '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                recursive = 1;
+                break;
+            case 'j':
+                jobs = strtol(optarg, &end, 10);
+                if(*optarg == '\0' || *end != '\0' || jobs < 1 || jobs > 1024){
+                    fprintf(stderr, "invalid number of jobs: '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
             default:
                 return EXIT_FAILURE;
@@ -258,256 +2637,207 @@ int main(int argc, char **argv){
         puts("See the man page for extensive documentation.");
         return EXIT_SUCCESS;
     }
-    if(optind != argc - 1){
+    if(files0_from || serve || manifest_from ? optind != argc : optind == argc){
         fputs("invalid arguments\n", stderr);
         return EXIT_FAILURE;
     }
-    if(inplace && path_out){
+    char *picture = NULL;
+    if(import_picture_from){
+        if((picture = import_picture(import_picture_from)) == NULL)
+            return EXIT_FAILURE;
+        to_delete[opts.edits.count_delete++] = "METADATA_BLOCK_PICTURE";
+        to_add[opts.edits.count_add++] = picture;
+    }
+    if(serve && manifest_from){
+        fputs("cannot combine --serve and --manifest\n", stderr);
+        return EXIT_FAILURE;
+    }
+    // A server never gets to save the cache.
+    if(serve && cache_path){
+        fputs("cannot combine --serve and --cache\n", stderr);
+        return EXIT_FAILURE;
+    }
+    // The cache only holds the tags of the first link.
+    if(opts.edits.link != 0 && cache_path){
+        fputs("cannot combine --link and --cache\n", stderr);
+        return EXIT_FAILURE;
+    }
+    // The totals are only reported once the batch is done.
+    if((serve || manifest_from) && opts.stats){
+        fprintf(stderr, "cannot combine %s and --stats\n", serve ? "--serve" : "--manifest");
+        return EXIT_FAILURE;
+    }
+    if((serve || manifest_from) && (files0_from || recursive || opts.path_out || opts.inplace || opts.edits.delete_all ||
+                                    opts.edits.count_add || opts.edits.count_delete || opts.edits.count_get)){
+        fprintf(stderr, "%s takes its files and edits from the requests\n", serve ? "--serve" : "--manifest");
+        return EXIT_FAILURE;
+    }
+    // Bulk listings and streams are written in large chunks, unless someone is watching.
+    if(!serve && (!opts.path_out || strcmp(opts.path_out, "-") == 0) && !opts.inplace && !isatty(STDOUT_FILENO))
+        setvbuf(stdout, NULL, _IOFBF, OUT_BUFFER_SIZE);
+    // A server answers several clients at once by default.
+    if(jobs == 0)
+        jobs = serve ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if(jobs < 1)
+        jobs = 1;
+    else if(jobs > 1024)
+        jobs = 1024;
+    if(opts.inplace && opts.path_out){
         fputs("cannot combine --in-place and --output\n", stderr);
         return EXIT_FAILURE;
     }
-    path_in = argv[optind];
-    if(path_out != NULL && strcmp(path_in, "-") != 0){
-        char canon_in[PATH_MAX+1], canon_out[PATH_MAX+1];
-        if(realpath(path_in, canon_in) && realpath(path_out, canon_out)){
-            if(strcmp(canon_in, canon_out) == 0){
-                fputs("error: the input and output files are the same\n", stderr);
-                return EXIT_FAILURE;
-            }
-        }
+    if(opts.edits.count_get && (opts.inplace || opts.path_out)){
+        fputs("--get only applies to listings\n", stderr);
+        return EXIT_FAILURE;
     }
-    FILE *in;
-    if(strcmp(path_in, "-") == 0){
-        if(set_all){
-            fputs("can't open stdin for input when -S is specified\n", stderr);
+    opts.batch = files0_from != NULL || recursive || optind < argc - 1;
+    if(opts.batch && opts.path_out){
+        fputs("cannot use --output with several input files\n", stderr);
+        return EXIT_FAILURE;
+    }
+    if(export_picture_to){
+        if(opts.inplace || opts.path_out){
+            fputs("--export-picture only applies to listings\n", stderr);
             return EXIT_FAILURE;
         }
-        if(inplace){
-            fputs("cannot modify stdin 'in-place'\n", stderr);
+        if(opts.batch || serve || manifest_from){
+            fputs("--export-picture takes a single input file\n", stderr);
             return EXIT_FAILURE;
         }
-        in = stdin;
-    }
-    else
-        in = fopen(path_in, "r");
-    if(!in){
-        perror("fopen");
-        return EXIT_FAILURE;
-    }
-    FILE *out = NULL;
-    if(inplace != NULL){
-        path_out = malloc(strlen(path_in) + strlen(inplace) + 1);
-        if(path_out == NULL){
-            fputs("failure to allocate memory\n", stderr);
-            fclose(in);
+        // Cached listings leave the pictures out.
+        if(cache_path){
+            fputs("cannot combine --export-picture and --cache\n", stderr);
+            return EXIT_FAILURE;
+        }
+        opts.picture = strcmp(export_picture_to, "-") == 0 ? stdout : fopen(export_picture_to, "wb");
+        if(!opts.picture){
+            perror("fopen");
             return EXIT_FAILURE;
         }
-        strcpy(path_out, path_in);
-        strcat(path_out, inplace);
     }
-    if(path_out != NULL){
-        if(strcmp(path_out, "-") == 0)
-            out = stdout;
-        else{
-            if(!overwrite && !inplace){
-                if(access(path_out, F_OK) == 0){
-                    fprintf(stderr, "'%s' already exists (use -y to overwrite)\n", path_out);
-                    fclose(in);
-                    return EXIT_FAILURE;
-                }
-            }
-            out = fopen(path_out, "w");
-            if(!out){
-                perror("fopen");
-                fclose(in);
-                if(inplace)
-                    free(path_out);
+    FILE *files0 = NULL;
+    if(files0_from){
+        if(strcmp(files0_from, "-") == 0){
+            if(opts.set_all){
+                fputs("can't read the file names from stdin when -S is specified\n", stderr);
                 return EXIT_FAILURE;
             }
+            files0 = stdin;
         }
-    }
-    ogg_sync_state oy;
-    ogg_stream_state os, enc;
-    ogg_page og;
-    ogg_packet op;
-    opus_tags tags;
-    ogg_sync_init(&oy);
-    char *buf;
-    size_t len;
-    char *error = NULL;
-    int packet_count = -1;
-    while(error == NULL){
-        // Read until we complete a page.
-        if(ogg_sync_pageout(&oy, &og) != 1){
-            if(feof(in))
-                break;
-            buf = ogg_sync_buffer(&oy, 65536);
-            if(buf == NULL){
-                error = "ogg_sync_buffer: out of memory";
-                break;
-            }
-            len = fread(buf, 1, 65536, in);
-            if(ferror(in))
-                error = strerror(errno);
-            ogg_sync_wrote(&oy, len);
-            if(ogg_sync_check(&oy) != 0)
-                error = "ogg_sync_check: internal error";
-            continue;
+        else
+            files0 = fopen(files0_from, "r");
+        if(!files0){
+            perror("fopen");
+            return EXIT_FAILURE;
         }
-        // We got a page.
-        // Short-circuit when the relevant packets have been read.
-        if(packet_count >= 2 && out){
-            if(write_page(&og, out) == -1){
-                error = "write_page: fwrite error";
-                break;
-            }
-            continue;
+    }
+    FILE *manifest = NULL;
+    if(manifest_from){
+        manifest = strcmp(manifest_from, "-") == 0 ? stdin : fopen(manifest_from, "r");
+        if(!manifest){
+            perror("fopen");
+            return EXIT_FAILURE;
         }
-        // Initialize the streams from the first page.
-        if(packet_count == -1){
-            if(ogg_stream_init(&os, ogg_page_serialno(&og)) == -1){
-                error = "ogg_stream_init: couldn't create a decoder";
-                break;
-            }
-            if(out){
-                if(ogg_stream_init(&enc, ogg_page_serialno(&og)) == -1){
-                    error = "ogg_stream_init: couldn't create an encoder";
-                    break;
-                }
-            }
-            packet_count = 0;
+    }
+    char *raw_tags = NULL;
+    if(opts.set_all){
+        raw_tags = read_comments(stdin, set_all_max, &opts.edits.to_set, &opts.edits.count_set);
+        if(raw_tags == NULL)
+            return EXIT_FAILURE;
+    }
+    if(opts.ring_depth > 0){
+#ifdef OPUSTAGS_URING
+        opustags_ring ring;
+        if(setup_ring(&ring, opts.ring_depth) == 0)
+            free_ring(&ring);
+        else{
+            perror("warning: io_uring_setup");
+            opts.ring_depth = 0;
         }
-        if(ogg_stream_pagein(&os, &og) == -1){
-            error = "ogg_stream_pagein: invalid page";
+#else
+        fputs("warning: io_uring isn't supported by this build\n", stderr);
+#endif
+    }
+    opustags_cache cache;
+    if(cache_path){
+        if(load_cache(&cache, cache_path) == -1)
+            return EXIT_FAILURE;
+        opts.cache = &cache;
+    }
+    opustags_batch batch = {
+        .paths = argv + optind,
+        .count = argc - optind,
+        .files0 = files0,
+        .files0_from = files0_from,
+        .opts = &opts,
+        .status = EXIT_SUCCESS,
+        .server = -1,
+        .request_max = set_all_max,
+        .manifest = manifest,
+        .manifest_from = manifest_from,
+        .recursive = recursive,
+    };
+    if(serve){
+        if((batch.server = open_server(serve)) == -1)
+            return EXIT_FAILURE;
+        // A client may leave before its reply.
+        signal(SIGPIPE, SIG_IGN);
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.turn, NULL);
+    pthread_cond_init(&batch.walked, NULL);
+    opustags_worker workers[jobs];
+    long i, started;
+    uint64_t wall = opts.stats ? clock_ns(CLOCK_MONOTONIC) : 0;
+    // The main thread is the first worker.
+    for(started=1; started<jobs; started++){
+        workers[started].batch = &batch;
+        if(pthread_create(&workers[started].thread, NULL, run_worker, &workers[started]) != 0){
+            fprintf(stderr, "warning: could only start %ld jobs\n", started);
             break;
         }
-        // Read all the packets.
-        while(ogg_stream_packetout(&os, &op) == 1){
-            packet_count++;
-            if(packet_count == 1){ // Identification header
-                if(strncmp((char*) op.packet, "OpusHead", 8) != 0){
-                    error = "opustags: invalid identification header";
-                    break;
-                }
-            }
-            else if(packet_count == 2){ // Comment header
-                if(parse_tags((char*) op.packet, op.bytes, &tags) == -1){
-                    error = "opustags: invalid comment header";
-                    break;
-                }
-                if(delete_all)
-                    tags.count = 0;
-                else{
-                    int i;
-                    for(i=0; i<count_delete; i++)
-                        delete_tags(&tags, to_delete[i]);
-                }
-                char *raw_tags = NULL;
-                if(set_all){
-                    raw_tags = malloc(16384);
-                    if(raw_tags == NULL){
-                        error = "malloc: not enough memory for buffering stdin";
-                        free(raw_tags);
-                        break;
-                    }
-                    else{
-                        char *raw_comment[256];
-                        size_t raw_len = fread(raw_tags, 1, 16383, stdin);
-                        if(raw_len == 16383)
-                            fputs("warning: truncating comment to 16 KiB\n", stderr);
-                        raw_tags[raw_len] = '\0';
-                        uint32_t raw_count = 0;
-                        size_t field_len = 0;
-                        int caught_eq = 0;
-                        size_t i = 0;
-                        char *cursor = raw_tags;
-                        for(i=0; i <= raw_len && raw_count < 256; i++){
-                            if(raw_tags[i] == '\n' || raw_tags[i] == '\0'){
-                                if(field_len == 0)
-                                    continue;
-                                if(caught_eq)
-                                    raw_comment[raw_count++] = cursor;
-                                else
-                                    fputs("warning: skipping malformed tag\n", stderr);
-                                cursor = raw_tags + i + 1;
-                                field_len = 0;
-                                caught_eq = 0;
-                                raw_tags[i] = '\0';
-                                continue;
-                            }
-                            if(raw_tags[i] == '=')
-                                caught_eq = 1;
-                            field_len++;
-                        }
-                        add_tags(&tags, (const char**) raw_comment, raw_count);
-                    }
-                }
-                add_tags(&tags, to_add, count_add);
-                if(out){
-                    ogg_packet packet;
-                    render_tags(&tags, &packet);
-                    if(ogg_stream_packetin(&enc, &packet) == -1)
-                        error = "ogg_stream_packetin: internal error";
-                    free(packet.packet);
-                }
-                else
-                    print_tags(&tags);
-                free_tags(&tags);
-                if(raw_tags)
-                    free(raw_tags);
-                if(error || !out)
-                    break;
-                else
-                    continue;
-            }
-            if(out){
-                if(ogg_stream_packetin(&enc, &op) == -1){
-                    error = "ogg_stream_packetin: internal error";
-                    break;
-                }
-            }
-        }
-        if(error != NULL)
-            break;
-        if(ogg_stream_check(&os) != 0)
-            error = "ogg_stream_check: internal error (decoder)";
-        // Write the page.
-        if(out){
-            ogg_stream_flush(&enc, &og);
-            if(write_page(&og, out) == -1)
-                error = "write_page: fwrite error";
-            else if(ogg_stream_check(&enc) != 0)
-                error = "ogg_stream_check: internal error (encoder)";
-        }
-        else if(packet_count >= 2) // Read-only mode
-            break;
     }
-    if(packet_count >= 0){
-        ogg_stream_clear(&os);
-        if(out)
-            ogg_stream_clear(&enc);
-    }
-    ogg_sync_clear(&oy);
-    fclose(in);
-    if(out)
-        fclose(out);
-    if(!error && packet_count < 2)
-        error = "opustags: invalid file";
-    if(error){
-        fprintf(stderr, "%s\n", error);
-        if(path_out != NULL && out != stdout)
-            remove(path_out);
-        if(inplace)
-            free(path_out);
-        return EXIT_FAILURE;
+    workers[0].batch = &batch;
+    run_worker(&workers[0]);
+    int status = batch.status;
+    for(i=0; i<started; i++){
+        if(i > 0)
+            pthread_join(workers[i].thread, NULL);
+        if(workers[i].status != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
     }
-    else if(inplace){
-        if(rename(path_out, path_in) == -1){
-            perror("rename");
-            free(path_out);
-            return EXIT_FAILURE;
+    if(opts.stats)
+        report_totals(workers, started, clock_ns(CLOCK_MONOTONIC) - wall);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.turn);
+    pthread_cond_destroy(&batch.walked);
+    free(batch.dirs);
+    free(batch.found);
+    if(finish_renames(&batch) == -1)
+        status = EXIT_FAILURE;
+    free(batch.renames);
+    if(opts.cache){
+        if(save_cache(opts.cache) == -1)
+            status = EXIT_FAILURE;
+        free_cache(opts.cache);
+    }
+    if(files0 && files0 != stdin)
+        fclose(files0);
+    if(batch.server != -1)
+        close(batch.server);
+    if(manifest && manifest != stdin)
+        fclose(manifest);
+    if(opts.picture && opts.picture != stdout){
+        if(fclose(opts.picture) == EOF){
+            perror("fclose");
+            status = EXIT_FAILURE;
         }
-        free(path_out);
+        // Don't leave a broken picture behind.
+        if(status != EXIT_SUCCESS)
+            unlink(export_picture_to);
     }
-    return EXIT_SUCCESS;
+    free(opts.edits.to_set);
+    free(raw_tags);
+    free(picture);
+    return status;
 }
@@ -0,0 +1,197 @@
+#ifndef OPUSTAGS_H
+#define OPUSTAGS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <ogg/ogg.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Error codes returned by the library. With OPUSTAGS_ERRNO, the cause is in errno.
+enum {
+    OPUSTAGS_OK = 0,
+    OPUSTAGS_ERRNO,
+    OPUSTAGS_NO_MEMORY,
+    OPUSTAGS_INVALID_FILE,
+    OPUSTAGS_INVALID_HEADER,
+    OPUSTAGS_INVALID_TAGS,
+    OPUSTAGS_INTERNAL,
+    OPUSTAGS_NO_LINK,
+    OPUSTAGS_NO_PICTURE,
+    OPUSTAGS_INVALID_PICTURE,
+    // An in-place rewrite failed midway, with the cause in errno.
+    OPUSTAGS_PARTIAL_WRITE,
+};
+
+const char *opustags_strerror(int error);
+
+// Copy of a comment that couldn't be used where it lies.
+typedef struct comment_copy {
+    struct comment_copy *next;
+    char data[];
+} comment_copy;
+
+typedef struct {
+    uint32_t vendor_length;
+    const char *vendor_string;
+    uint32_t count;
+    uint32_t *lengths;
+    const char **comment;
+    long padding;
+    // Size of the bytes after the comments when they aren't padding, as their
+    // first bit is set (RFC 7845, section 5.2). They are written back after the
+    // comments, from trailing, and padding is then 0.
+    long trailing_data;
+    const char *trailing;
+    // Pages the packet was parsed from, when it wasn't copied out of them.
+    // The strings then point to the page bodies, and may continue on the
+    // following pages, though their field name is always contiguous.
+    const ogg_page *pages;
+    int page_count;
+    comment_copy *copies;
+} opus_tags;
+
+// The strings of the tags point to data, which must outlive them.
+int parse_tags(char *data, long len, opus_tags *tags);
+void free_tags(opus_tags *tags);
+
+// Point data to the contiguous bytes of the string s of length len, starting
+// at offset, and return their count. Use it to read the comments, which may
+// be split across pages.
+long tags_span(const opus_tags *tags, const char *s, long len, long offset, const char **data);
+
+// Size of the OpusTags packet, padding excluded but trailing data included.
+long tags_size(const opus_tags *tags);
+
+// Write the OpusTags packet to data if it fits in size bytes.
+// Return the size of the packet, padding included.
+long render_tags(const opus_tags *tags, unsigned char *data, long size);
+
+// Whether the comment of len bytes is of the field named by field, which may be
+// followed by '=' and a value. Field names are compared regardless of case.
+int match_field(const char *comment, uint32_t len, const char *field);
+int delete_tags(opus_tags *tags, const char **fields, int count);
+int add_tags(opus_tags *tags, const char **tags_to_add, uint32_t count);
+// Drop the comments whose field is none of the given ones, unless there are none.
+int keep_tags(opus_tags *tags, const char **fields, int count);
+
+// Changes applied to the tags of a file. The strings must outlive the calls.
+typedef struct {
+    const char **to_add;
+    int count_add;
+    const char **to_delete;
+    int count_delete;
+    int delete_all;
+    // Added before to_add, typically the tags read by --set-all.
+    const char **to_set;
+    uint32_t count_set;
+    // Padding of the new comment header, or -1 to keep the original one.
+    long pad;
+    // Trust the checksums of the pages that need renumbering.
+    int no_verify_tail;
+    // When only listing the tags, the fields to keep after the other edits.
+    const char **to_get;
+    int count_get;
+    // Link of a chained stream whose tags are edited, counting from 0, or
+    // OPUSTAGS_ALL_LINKS. The other links are copied as they are.
+    int link;
+} opustags_edits;
+
+#define OPUSTAGS_ALL_LINKS -1
+
+int edit_tags(opus_tags *tags, const opustags_edits *edits);
+
+// Cover art is kept as a METADATA_BLOCK_PICTURE comment, holding a FLAC picture
+// block in base64.
+// Write the picture of the first such comment to out.
+int export_picture(const opus_tags *tags, FILE *out);
+// Set *comment to a new comment holding the PNG, JPEG, GIF or WebP image of size
+// bytes as the front cover, described from its header. It must be freed.
+int make_picture(const unsigned char *image, size_t size, char **comment);
+
+// Called with the edited tags of a file, before they are written. They may be
+// edited further when only listing them.
+typedef void opustags_inspect(opus_tags *tags, void *arg);
+
+// Phases of the work on a file, as timed by opustags_stats.
+enum {
+    OPUSTAGS_PHASE_READ,    // Reading the input up to the end of the headers
+    OPUSTAGS_PHASE_PAGEOUT, // Finding their pages and packets
+    OPUSTAGS_PHASE_PARSE,   // Parsing the comment header
+    OPUSTAGS_PHASE_EDIT,    // Editing the tags and passing them to inspect
+    OPUSTAGS_PHASE_RENDER,  // Writing the new comment header
+    OPUSTAGS_PHASE_WRITE,   // Writing the other header pages
+    OPUSTAGS_PHASE_TAIL,    // Copying the rest of the stream
+    OPUSTAGS_PHASES,
+};
+
+// Ways a file was handled, set in the paths of opustags_stats.
+#define OPUSTAGS_PATH_MAPPED 1      // The input file was mapped in memory.
+#define OPUSTAGS_PATH_DIRECT 2      // The comment header was parsed where it lies in memory.
+#define OPUSTAGS_PATH_IN_PLACE 4    // The comment header was rewritten inside the file.
+#define OPUSTAGS_PATH_CLONE 8       // The audio was shared with the input by reflink,
+#define OPUSTAGS_PATH_KERNEL_COPY 16 // or copied by the kernel,
+#define OPUSTAGS_PATH_RENUMBER 32   // or copied page by page to renumber them.
+
+// Work done on files, added up while the stats of their context are set.
+// The times are in nanoseconds, of wall clock and of CPU time of the thread.
+typedef struct {
+    uint64_t bytes_read, bytes_written;
+    // Pages read up to the end of the headers, and past them.
+    uint64_t header_pages, tail_pages;
+    // Comments and size of the edited comment header, padding included.
+    uint64_t comments, header_size;
+    uint64_t wall_ns[OPUSTAGS_PHASES], cpu_ns[OPUSTAGS_PHASES];
+    int paths;
+} opustags_stats;
+
+// State that may be kept from one file to the next, but not shared by threads.
+typedef struct {
+    ogg_sync_state oy;
+    ogg_stream_state os, enc;
+    ogg_page *pages;
+    int page_capacity;
+    // Where the work is accounted for, unless NULL, as set by init_context.
+    opustags_stats *stats;
+} opustags_context;
+
+int init_context(opustags_context *ctx);
+void free_context(opustags_context *ctx);
+
+// The output replaces the input: on file systems with reflinks, found by cloning
+// a block, the audio is aligned so that it can be shared between both files,
+// unless the padding is set.
+#define OPUSTAGS_CLONE 1
+// Leave the part of a regular file read to list its tags in the page cache, as when
+// the same files are read again and again.
+#define OPUSTAGS_KEEP_CACHE 2
+// When only listing the tags of a regular file, parse its comment header where it
+// lies without verifying the checksums, so that the comments are only read when
+// used, as when listing a few of them.
+#define OPUSTAGS_LAZY 4
+
+// Edit the tags of the Ogg Opus stream read from in, and write the new stream
+// to out, or only pass the tags to inspect if out is NULL. Neither is closed.
+int edit_file(opustags_context *ctx, const opustags_edits *edits, int in, FILE *out, int flags,
+              opustags_inspect *inspect, void *arg);
+
+// Same as edit_file for a stream held in memory.
+int edit_buffer(opustags_context *ctx, const opustags_edits *edits, const unsigned char *data, size_t size,
+                FILE *out, opustags_inspect *inspect, void *arg);
+
+// Overwrite the comment header pages of the file open for reading and writing
+// as fd, when the edited header fits in them. *rewritten is set once they are
+// all written. Otherwise, the file is left untouched and must be copied with
+// edit_file, unless OPUSTAGS_PARTIAL_WRITE is returned: then some of the pages
+// may have been overwritten, and the file may be corrupt.
+int rewrite_in_place(opustags_context *ctx, const opustags_edits *edits, int fd,
+                     opustags_inspect *inspect, void *arg, int *rewritten);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif